@@ -0,0 +1,228 @@
+/*
+ * Copyright 2026 Diomidis Spinellis
+ *
+ * Fast block compression of temporary file data.
+ * The compressor is a greedy LZ77 matcher with a single-entry hash
+ * table, producing data in the LZ4 block format: a sequence of
+ * literal runs, each followed by a back-reference match.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "compress.h"
+
+/* Shortest match that can be encoded */
+#define MIN_MATCH 4
+
+/* Longest back-reference distance */
+#define MAX_OFFSET 65535
+
+/* The block's last bytes are always literals */
+#define LAST_LITERALS 5
+
+/* No match can start within this many bytes of the block's end */
+#define MF_LIMIT 12
+
+/* Log2 of the number of hash table entries */
+#define HASH_LOG 12
+
+static uint32_t
+read32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* Return the hash table index for the four bytes in v */
+static unsigned
+hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/* Return the number of bytes needed to encode a token length field */
+static size_t
+length_size(size_t len)
+{
+	return len < 15 ? 0 : (len - 15) / 255 + 1;
+}
+
+/* Encode in op the part of a length that doesn't fit in its token */
+static unsigned char *
+length_write(unsigned char *op, size_t len)
+{
+	for (len -= 15; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = (unsigned char)len;
+	return op;
+}
+
+/*
+ * Append to op a sequence of lit literals starting at anchor,
+ * followed, if mlen is not 0, by a match of mlen bytes at offset.
+ * Return the new output position, or NULL if oend would be exceeded.
+ */
+static unsigned char *
+sequence_write(unsigned char *op, unsigned char *oend,
+    const unsigned char *anchor, size_t lit, size_t offset, size_t mlen)
+{
+	unsigned char *token;
+	size_t need;
+
+	need = 1 + length_size(lit) + lit;
+	if (mlen)
+		need += 2 + length_size(mlen - MIN_MATCH);
+	if (need > (size_t)(oend - op))
+		return NULL;
+
+	token = op++;
+	*token = (lit < 15 ? lit : 15) << 4;
+	if (lit >= 15)
+		op = length_write(op, lit);
+	memcpy(op, anchor, lit);
+	op += lit;
+	if (mlen == 0)
+		return op;
+
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	mlen -= MIN_MATCH;
+	*token |= mlen < 15 ? mlen : 15;
+	if (mlen >= 15)
+		op = length_write(op, mlen);
+	return op;
+}
+
+size_t
+dgsh_compress(const void *src, size_t n, void *dst, size_t dst_size)
+{
+	const unsigned char *base = src;
+	const unsigned char *iend = base + n;
+	const unsigned char *ip = base, *anchor = base;
+	const unsigned char *match, *mp, *p;
+	unsigned char *op = dst, *oend = op + dst_size;
+	uint32_t table[1 << HASH_LOG];
+	uint32_t seq;
+	unsigned h;
+
+	if (n >= MF_LIMIT) {
+		const unsigned char *mflimit = iend - MF_LIMIT;
+		const unsigned char *matchlimit = iend - LAST_LITERALS;
+
+		memset(table, 0, sizeof(table));
+		while (ip < mflimit) {
+			seq = read32(ip);
+			h = hash(seq);
+			match = base + table[h];
+			table[h] = (uint32_t)(ip - base);
+			if (match >= ip || ip - match > MAX_OFFSET ||
+			    read32(match) != seq) {
+				ip++;
+				continue;
+			}
+
+			/* Extend the match backward over the pending literals */
+			while (ip > anchor && match > base && ip[-1] == match[-1]) {
+				ip--;
+				match--;
+			}
+			/* And forward, up to the trailing literals */
+			for (p = ip + MIN_MATCH, mp = match + MIN_MATCH;
+			    p < matchlimit && *p == *mp; p++, mp++)
+				;
+
+			op = sequence_write(op, oend, anchor, ip - anchor,
+			    ip - match, p - ip);
+			if (op == NULL)
+				return 0;
+			ip = anchor = p;
+			/* Index a position within the match for the next search */
+			table[hash(read32(ip - 2))] = (uint32_t)(ip - 2 - base);
+		}
+	}
+	op = sequence_write(op, oend, anchor, iend - anchor, 0, 0);
+	if (op == NULL)
+		return 0;
+	return op - (unsigned char *)dst;
+}
+
+/*
+ * Decode from *ipp a length extension and add it to *len.
+ * Return 0 on success, -1 if the input ends prematurely.
+ */
+static int
+length_read(const unsigned char **ipp, const unsigned char *iend, size_t *len)
+{
+	unsigned char b;
+
+	do {
+		if (*ipp >= iend)
+			return -1;
+		b = *(*ipp)++;
+		*len += b;
+	} while (b == 255);
+	return 0;
+}
+
+ssize_t
+dgsh_decompress(const void *src, size_t n, void *dst, size_t dst_size)
+{
+	const unsigned char *ip = src, *iend = ip + n;
+	unsigned char *op = dst, *oend = op + dst_size;
+	const unsigned char *match;
+	size_t lit, offset, mlen;
+	unsigned token;
+
+	while (ip < iend) {
+		token = *ip++;
+		lit = token >> 4;
+		if (lit == 15 && length_read(&ip, iend, &lit) < 0)
+			return -1;
+		if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		/* The last sequence has no match */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - (unsigned char *)dst))
+			return -1;
+		mlen = token & 15;
+		if (mlen == 15 && length_read(&ip, iend, &mlen) < 0)
+			return -1;
+		mlen += MIN_MATCH;
+		if (mlen > (size_t)(oend - op))
+			return -1;
+		match = op - offset;
+		if (offset >= mlen)
+			memcpy(op, match, mlen);
+		else	/* Overlapping copy repeats the recent data */
+			for (size_t i = 0; i < mlen; i++)
+				op[i] = match[i];
+		op += mlen;
+	}
+	return op - (unsigned char *)dst;
+}
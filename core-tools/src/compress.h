@@ -0,0 +1,38 @@
+/*
+ * Copyright 2026 Diomidis Spinellis
+ *
+ * Fast block compression of temporary file data.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <sys/types.h>
+
+/*
+ * Compress the n bytes of src into dst, which can hold dst_size bytes.
+ * Return the compressed length, or 0 if the result does not fit.
+ * The output uses the LZ4 block format.
+ */
+size_t dgsh_compress(const void *src, size_t n, void *dst, size_t dst_size);
+
+/*
+ * Decompress the n bytes of src into dst, which can hold dst_size bytes.
+ * Return the decompressed length, or -1 if the data are corrupt.
+ */
+ssize_t dgsh_decompress(const void *src, size_t n, void *dst, size_t dst_size);
+
+#endif /* COMPRESS_H */
@@ -0,0 +1,303 @@
+/*
+ * Copyright 2026 Diomidis Spinellis
+ *
+ * Run a command with a central dgsh negotiation broker.
+ * The command's dgsh processes find the broker's socket through the
+ * DGSH_BROKER environment variable, and register with it their
+ * I/O requirements and the processes at their negotiation ports.
+ * Once all processes of a graph have registered, the broker solves
+ * the graph and sends each process its pipes, thereby avoiding the
+ * repeated circulation of the message block among the processes.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "negotiate.h"		/* broker_read_request(), broker_solve() */
+#include "dgsh-debug.h"		/* DPRINTF */
+
+static const char *program_name;
+
+/* Connections whose registration has not yet been completely read */
+static struct broker_client *pending;
+static int n_pending;
+
+/* Processes registered with the broker, awaiting their graph's solution */
+static struct broker_client *clients;
+static int n_clients;
+
+/* Written when a child exits, to wake up poll(2) */
+static int child_pipe[2];
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: %s command [argument ...]\n", program_name);
+	exit(1);
+}
+
+static void
+child_handler(int signo)
+{
+	int saved_errno = errno;
+
+	(void)signo;
+	(void)write(child_pipe[1], "", 1);
+	errno = saved_errno;
+}
+
+/* Allow the broker to hold the pipes of large graphs */
+static void
+raise_fd_limit(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		(void)setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+/* Return the index of the registered client with the given pid, or -1 */
+static int
+find_client(pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < n_clients; i++)
+		if (clients[i].req.pid == pid)
+			return i;
+	return -1;
+}
+
+/*
+ * If all processes connected to the registered client at index start
+ * have registered, solve their graph, send them the solution,
+ * and remove them from the registered clients.
+ */
+static void
+serve_graph(int start)
+{
+	struct broker_client *graph;
+	bool *member;
+	int *queue;
+	int i, j, p, head = 0, n = 0;
+
+	if ((member = calloc(n_clients, sizeof(bool))) == NULL ||
+	    (queue = malloc(n_clients * sizeof(int))) == NULL)
+		err(1, NULL);
+	member[start] = true;
+	queue[n++] = start;
+	while (head < n) {
+		struct broker_client *c = &clients[queue[head++]];
+
+		for (p = 0; p < c->req.n_ports; p++) {
+			if (c->ports[p] == 0)
+				continue;
+			if ((j = find_client(c->ports[p])) == -1) {
+				DPRINTF(3, "%s(): waiting for pid %d",
+						__func__, (int)c->ports[p]);
+				goto out;
+			}
+			if (!member[j]) {
+				member[j] = true;
+				queue[n++] = j;
+			}
+		}
+	}
+
+	DPRINTF(1, "%s(): graph of %d processes registered", __func__, n);
+	if ((graph = malloc(n * sizeof(*graph))) == NULL)
+		err(1, NULL);
+	for (i = 0; i < n; i++)
+		graph[i] = clients[queue[i]];
+	broker_solve(graph, n);
+	for (i = 0; i < n; i++) {
+		broker_send_reply(&graph[i]);
+		close(graph[i].fd);
+	}
+	free(graph);
+
+	for (i = j = 0; i < n_clients; i++)
+		if (!member[i])
+			clients[j++] = clients[i];
+	n_clients = j;
+out:
+	free(member);
+	free(queue);
+}
+
+/*
+ * Read the available part of the registration of the pending connection
+ * at index i, and register the process once its registration is complete.
+ */
+static void
+register_client(int i)
+{
+	struct broker_client client = pending[i];
+	enum op_result re;
+
+	if ((re = broker_read_request(&client)) == OP_RETRY) {
+		pending[i] = client;
+		return;
+	}
+	pending[i] = pending[--n_pending];
+	if (re == OP_ERROR) {
+		warnx("Invalid registration from a dgsh process");
+		free(client.ports);
+		close(client.fd);
+		return;
+	}
+	/* The reply carries file descriptors; send it in one go */
+	fcntl(client.fd, F_SETFL, fcntl(client.fd, F_GETFL) & ~O_NONBLOCK);
+	if ((clients = realloc(clients, (n_clients + 1) *
+			sizeof(*clients))) == NULL)
+		err(1, NULL);
+	clients[n_clients] = client;
+	serve_graph(n_clients++);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_un addr;
+	struct pollfd *pfd = NULL;
+	struct sigaction sa;
+	char dir[PATH_MAX];
+	const char *tmp;
+	char *debug_level;
+	int lsock, i, status;
+	pid_t child;
+	char c;
+
+	program_name = argv[0];
+	if (argc < 2 || argv[1][0] == '-')
+		usage();
+
+	/* The broker itself takes no part in a negotiation */
+	set_negotiation_complete();
+	debug_level = getenv("DGSH_DEBUG_LEVEL");
+	if (debug_level != NULL)
+		dgsh_debug_level = atoi(debug_level);
+	raise_fd_limit();
+
+	if ((tmp = getenv("TMPDIR")) == NULL)
+		tmp = "/tmp";
+	snprintf(dir, sizeof(dir), "%s/dgsh-broker-XXXXXX", tmp);
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp %s", dir);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/socket", dir) >=
+			(int)sizeof(addr.sun_path))
+		errx(1, "Socket path in %s is too long", dir);
+	if ((lsock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	if (bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+		err(1, "bind %s", addr.sun_path);
+	if (listen(lsock, SOMAXCONN) == -1)
+		err(1, "listen");
+	if (pipe(child_pipe) == -1)
+		err(1, "pipe");
+	fcntl(lsock, F_SETFD, FD_CLOEXEC);
+	fcntl(child_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(child_pipe[1], F_SETFD, FD_CLOEXEC);
+	fcntl(child_pipe[1], F_SETFL, O_NONBLOCK);
+	if (setenv("DGSH_BROKER", addr.sun_path, 1) == -1)
+		err(1, "setenv");
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = child_handler;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGCHLD, &sa, NULL) == -1)
+		err(1, "sigaction");
+
+	switch (child = fork()) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		execvp(argv[1], argv + 1);
+		err(127, "%s", argv[1]);
+	}
+
+	/* A vanishing process must not terminate the broker */
+	signal(SIGPIPE, SIG_IGN);
+
+	for (;;) {
+		if ((pfd = realloc(pfd, (n_pending + 2) * sizeof(*pfd))) == NULL)
+			err(1, NULL);
+		pfd[0].fd = child_pipe[0];
+		pfd[1].fd = lsock;
+		for (i = 0; i < n_pending; i++)
+			pfd[i + 2].fd = pending[i].fd;
+		for (i = 0; i < n_pending + 2; i++)
+			pfd[i].events = POLLIN;
+		if (poll(pfd, n_pending + 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+
+		if (pfd[0].revents) {
+			(void)read(child_pipe[0], &c, 1);
+			if (waitpid(child, &status, WNOHANG) == child)
+				break;
+		}
+		/* Registrations first; the pending array changes below */
+		for (i = n_pending - 1; i >= 0; i--)
+			if (pfd[i + 2].revents)
+				register_client(i);
+		if (pfd[1].revents) {
+			int fd;
+
+			if ((fd = accept(lsock, NULL, NULL)) == -1) {
+				if (errno != EINTR && errno != ECONNABORTED)
+					warn("accept");
+				continue;
+			}
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+			fcntl(fd, F_SETFL, O_NONBLOCK);
+			if ((pending = realloc(pending, (n_pending + 1) *
+					sizeof(*pending))) == NULL)
+				err(1, NULL);
+			memset(&pending[n_pending], 0, sizeof(*pending));
+			pending[n_pending++].fd = fd;
+		}
+	}
+
+	if (n_clients)
+		DPRINTF(1, "%d processes left without a solution", n_clients);
+	unlink(addr.sun_path);
+	rmdir(dir);
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
@@ -33,7 +33,8 @@
 #include <signal.h>		/* sig_atomic_t */
 
 #include "negotiate.h"		/* read/write_message_block(),
-				   set_negotiation_complete() */
+				   set_negotiation_complete(),
+				   broker_register() */
 #include "dgsh-debug.h"		/* DPRINTF */
 
 #define DGSH_TIMEOUT 5
@@ -520,6 +521,40 @@ gather_input_fds(struct dgsh_negotiation *mb)
 
 }
 
+/*
+ * Register the concentrator and the processes at its ports with the
+ * negotiation broker, which connects the processes directly.
+ * Return the negotiation's state.
+ */
+STATIC int
+register_with_broker(int broker)
+{
+	struct broker_request req;
+	struct broker_reply reply;
+	pid_t *ports;
+	int i;
+
+	memset(&req, 0, sizeof(req));
+	req.pid = pid;
+	strcpy(req.name, "dgsh-conc");
+	req.is_conc = true;
+	req.multiple_inputs = multiple_inputs;
+	if ((ports = (pid_t *)malloc(nfd * sizeof(pid_t))) == NULL)
+		err(1, NULL);
+	for (i = 0; i < nfd; i++) {
+		if (i == STDERR_FILENO)
+			continue;
+		if (noinput && i == STDIN_FILENO)
+			ports[req.n_ports++] = 0;
+		else
+			ports[req.n_ports++] = peer_pid(i, pid);
+	}
+	broker_register(broker, &req, ports, &reply);
+	free(ports);
+	close(broker);
+	return reply.state;
+}
+
 #ifndef UNIT_TESTING
 
 int
@@ -527,6 +562,7 @@ main(int argc, char *argv[])
 {
 	int ch;
 	int exit;
+	int broker;
 	char *debug_level = NULL;
 	char *timeout;
 
@@ -579,7 +615,16 @@ main(int argc, char *argv[])
 	pi = (struct portinfo *)calloc(nfd, sizeof(struct portinfo));
 
 	chosen_mb = NULL;
-	exit = pass_message_blocks();
+	if ((broker = broker_connect()) != -1) {
+		exit = register_with_broker(broker);
+		/* The broker connects the processes at the ports directly */
+		if (exit == PS_RUN)
+			exit = PS_COMPLETE;
+	} else
+		exit = pass_message_blocks();
+	/* As with tools, a graph drawn without running it is no failure */
+	if (exit == PS_DRAW_EXIT)
+		exit = PS_COMPLETE;
 	if (exit == PS_RUN) {
 		if (noinput)
 			DPRINTF(1, "%s(): Special (no-input) conc communicated the solution", __func__);
@@ -589,7 +634,8 @@ main(int argc, char *argv[])
 			scatter_input_fds(chosen_mb);
 		exit = PS_COMPLETE;
 	}
-	free_mb(chosen_mb);
+	if (chosen_mb)
+		free_mb(chosen_mb);
 	free(pi);
 	DPRINTF(3, "conc with pid %d terminates %s",
 		pid, exit == PS_COMPLETE ? "normally" : "with error");
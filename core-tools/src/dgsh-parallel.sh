@@ -26,13 +26,16 @@ unset DGSH_OUT
 
 usage()
 {
-  echo 'Usage: dgsh-parallel [-d] -n n|-f file|-l list command ...' 1>&2
+  echo 'Usage: dgsh-parallel [-bd] -n n|-f file|-l list command ...' 1>&2
   exit 2
 }
 
 # Process flags
-while getopts 'df:l:n:' o; do
+while getopts 'bdf:l:n:' o; do
   case "$o" in
+    b)
+      BROKER=1
+      ;;
     d)
       DEBUG=1
       ;;
@@ -120,4 +123,9 @@ PATH="$OPATH"
 test "$ODGSH_IN" && export DGSH_IN="$ODGSH_IN"
 test "$ODGSH_OUT" && export DGSH_OUT="$ODGSH_OUT"
 
-dgsh $SCRIPT
+# Negotiate through a broker, unless part of an enclosing graph
+if [ "$BROKER" ] && [ -z "$ODGSH_IN$ODGSH_OUT$DGSH_BROKER" ] ; then
+  dgsh-broker dgsh $SCRIPT
+else
+  dgsh $SCRIPT
+fi
@@ -16,27 +16,48 @@
  */
 
 #ifdef __linux__
+#define _GNU_SOURCE		// splice tee fallocate
 #define _XOPEN_SOURCE 500	// pread pwrite
 #endif
 
 #include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#else
 #include <sys/select.h>
+#endif
 #include <assert.h>
+#include <ctype.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "dgsh.h"
 #include "dgsh-debug.h"
+#include "compress.h"
 #include "minmax.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
 #if defined(DEBUG_DATA)
 #define DATA_DUMP 1
 #else
@@ -63,8 +84,13 @@ struct pool_buffer {
 		s_none,		/* Stored nowhere */
 		s_memory,	/* Stored in memory */
 		s_memory_backed,/* Stored in memory and backed to temporary file */
-		s_file		/* Stored in temporary file */
+		s_file,		/* Stored in temporary file */
+		s_paging_out,	/* Stored in memory, being written to temporary file */
+		s_paging_in,	/* Stored in temporary file, being read to memory */
+		s_mapped	/* Part of a read-only mapping of the source file */
 	} s; 			/* Where it is stored */
+	off_t file_offset;	/* Temporary file extent of the stored data */
+	size_t file_length;	/* (buffer_size if not compressed) */
 };
 
 /*
@@ -77,12 +103,17 @@ struct buffer_pool {
 
 	/* Allocated bufffer information */
 	int buffers_allocated, buffers_freed, max_buffers_allocated;
+	int buffers_reused;		/* Allocations satisfied from recycled buffers */
+	int buffers_mapped;		/* Buffers served from a file mapping */
 
 	/* Paging information */
 	int buffers_paged_out, buffers_paged_in, pages_freed;
+	long long bytes_spilled;	/* Data written to the temporary file */
+	long long bytes_stored;		/* Temporary file space they occupy */
 
-	int page_out_ptr;		/* Pointer to first buffer to page out */
+	int buffers_paging_out;		/* Buffers being written to the temporary file */
 	int page_file_fd;		/* File descriptor of temporary file used for paging buffer pool */
+	off_t page_file_end;		/* End of compressed extents; used by the paging thread */
 	int free_pool_begin;		/* Start of freed area */
 };
 
@@ -97,14 +128,17 @@ new_buffer_pool(void)
 		err(1, NULL);
 	bp->buffers = NULL;
 	bp->pool_size = 0;
-	bp->page_out_ptr = 0;
+	bp->buffers_paging_out = 0;
 	bp->page_file_fd = -1;
+	bp->page_file_end = 0;
 	bp->free_pool_begin = 0;
 
 	bp->allocated_pool_end = 0;
 
 	bp->buffers_allocated = bp->buffers_freed = bp->max_buffers_allocated =
+	bp->buffers_reused = bp->buffers_mapped = 0;
 	bp->buffers_paged_out = bp->buffers_paged_in = bp->pages_freed = 0;
+	bp->bytes_spilled = bp->bytes_stored = 0;
 
 	return bp;
 }
@@ -121,9 +155,108 @@ struct io_buffer {
 /* Maximum amount of memory to allocate. (Set through -S) */
 static unsigned long max_mem = 256 * 1024 * 1204;
 
+/* True if the maximum amount of memory was specified */
+static bool opt_max_mem = false;
+
+/* Back buffer memory with huge pages (set through -H) */
+static bool opt_huge_pages = false;
+
+/* Size of the huge pages used with MAP_HUGETLB */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/*
+ * Freed pool buffers kept for reuse, in order to avoid the cost of
+ * allocating memory and faulting in its pages for every new buffer.
+ * Together with the buffers in use they are bounded by max_mem.
+ */
+static void **free_buffers;
+static int free_buffers_n, free_buffers_size;
+
+/* Number of buffers in use across all buffer pools */
+static int buffers_in_use;
+
+/*
+ * Memory budget shared by the tees of a negotiated graph
+ * (set through the DGSH_MEMORY environment variable).
+ * The memory of the buffers each tee holds, including the ones kept
+ * for reuse, is counted in a shared memory segment named after the
+ * graph, so that it is granted to the tees that need it.
+ * Each tee also records there its identity and the memory it holds,
+ * so that the memory of tees that were killed can be reclaimed,
+ * for example from a segment left behind by an earlier graph
+ * with the same identifier.
+ */
+#define GRAPH_USERS 256
+
+struct graph_user {
+	atomic_int pid;		/* Tee's process id; 0 if free, -1 if changing */
+	unsigned long long start;	/* Its start time, see process_start_time() */
+	atomic_long held;	/* Bytes it holds */
+};
+
+struct graph_memory {
+	atomic_long used;	/* Bytes held by the graph's tees */
+	atomic_int users;	/* Tees sharing the budget; -1 once removed */
+	struct graph_user user[GRAPH_USERS];
+};
+static struct graph_memory *graph_memory;
+static struct graph_user *graph_user;	/* This tee's entry, if one was free */
+static unsigned long graph_limit;	/* Size of the budget */
+static unsigned long graph_held;	/* Bytes held by this tee */
+static char graph_name[64];		/* Name of the shared memory segment */
+
+/* Minimum interval in seconds between searches for killed tees */
+#define GRAPH_RECLAIM_INTERVAL 1
+
+/* Attempts to open the segment while an earlier one is being removed */
+#define GRAPH_OPEN_TRIES 1000
+
+/* Freed buffers kept for reuse when sharing the graph's budget */
+#define GRAPH_FREE_BUFFERS 4
+
+/* Buffers a pool can always hold, so that its input can make progress */
+#define GRAPH_MIN_BUFFERS 2
+
 /* Scatter the output across the files, rather than copying it. */
 static bool opt_scatter = false;
 
+/* How scattered data are divided among the sinks (set through -S) */
+static enum scatter_policy {
+	sp_equal,	/* Equal parts to all available sinks */
+	sp_outstanding,	/* Equalize the data waiting to be read by each sink */
+	sp_rate,	/* Parts proportional to each sink's drain rate */
+	sp_hash,	/* Records partitioned by the hash of their keys */
+	sp_range,	/* Records partitioned by sampled key ranges */
+	sp_split,	/* A regular file divided into contiguous parts */
+} scatter_policy = sp_equal;
+
+/* True if scattered records are routed to sinks by their keys */
+#define partitioning() (scatter_policy == sp_hash || scatter_policy == sp_range)
+
+/*
+ * How copied data are delivered to a sink (set through -L for the
+ * subsequently specified -o files).
+ * Lossy sinks receive whole records and never hold back the freeing
+ * of buffers the other sinks have written by more than a share of
+ * the memory limit, or at all when memory runs out: when they lag
+ * beyond that, they skip to the first record that is still buffered.
+ */
+enum output_policy {
+	op_all,		/* All data, buffering them when the sink lags */
+	op_drop,	/* All records, dropping them when the sink lags */
+	op_sample,	/* Every Nth record */
+	op_rate,	/* Records up to a number of bytes per second */
+};
+
+/* Share (1/n) of max_mem by which a lossy sink may lag without dropping data */
+#define LOSSY_LAG_SHARE 2
+
+/* Minimum interval in seconds between drain rate samples */
+#define DRAIN_SAMPLE_INTERVAL 0.01
+
+/* Weight of a new sample in the drain rate's moving average */
+#define DRAIN_RATE_WEIGHT 0.25
+
 /*
  * When set, permute the inputs to the specified outputs
  * Ordinals and number of the destination outputs
@@ -131,18 +264,150 @@ static bool opt_scatter = false;
 static int *permute_dest = NULL;
 static int permute_n = 0;
 
+/* Move data between pipes with splice(2) and tee(2), when possible */
+static bool opt_zero_copy = false;
+
+/*
+ * Capacity to set for input and output pipes, and maximum size of
+ * adaptive reads (set through -P); 0 to leave I/O sizes as they are.
+ * Larger transfers reduce the system calls and context switches
+ * of the processes on both sides of the pipes.
+ */
+static unsigned long opt_pipe_size = 0;
+
+/* Smallest adaptive read size */
+#define READ_SIZE_MIN 4096
+
+/* Weight of a new read in the moving average of the read size */
+#define READ_SIZE_WEIGHT 0.25
+
+/* Number of writer threads (set through -j); 0 to use the event loop */
+static int opt_writers = 0;
+
+/* How multiple inputs are gathered (set through -g) */
+static enum gather_mode {
+	gm_concatenate,	/* Concatenate them in sequence */
+	gm_merge,	/* Merge their sorted records in key order */
+	gm_seq,		/* Order their chunks by sequence tag */
+	gm_any,		/* Interleave their records as they arrive */
+} gather_mode = gm_concatenate;
+
+/* A key on which merged records are ordered (set through -k) */
+struct sort_key {
+	int field_begin;	/* First field (0-based) */
+	int field_end;		/* Last field (0-based); -1 for the record's end */
+	bool numeric;		/* Compare as numbers */
+	bool reverse;		/* Reverse the comparison's result */
+};
+
+static struct sort_key *sort_keys;
+static int nsort_keys;
+
+/* The source from which sinks read the gathered records (-g merge, seq, any) */
+static struct source_info *gather_ifp;
+
+/* Inputs with a record to merge, as a heap ordered on that record */
+static struct source_info **merge_heap;
+static int merge_heap_n;
+
+/* Inputs without a complete record that are needed for merging */
+static struct source_info **merge_waiting;
+static int merge_waiting_n;
+
+/* Bytes of the heap's top record already appended to gather_ifp */
+static size_t merge_head_written;
+
+/*
+ * Input whose records up to any_end are being appended to gather_ifp
+ * (-g any), and whether a terminator must then be added to its
+ * unterminated final record.
+ */
+static struct source_info *any_ifp;
+static off_t any_end;
+static bool any_terminate;
+
+/*
+ * Sources holding the records routed to each sink (-S hash), and the
+ * sinks reading them.  All records with the same keys (-k) are routed
+ * to the same partition.
+ */
+static struct source_info **partitions;
+static struct sink_info **partition_sinks;
+static int npartitions;
+
+/* The input whose records are being partitioned */
+static struct source_info *partition_ifp;
+
+/* Partition and end of the record being copied; NULL if none */
+static struct source_info *partition_dest;
+static off_t partition_end;
+
+/* Contiguous copy of a record, for examining its keys */
+static char *partition_record;
+static size_t partition_record_size;
+
+/* Default size of the input's first part sampled for range partitioning */
+#define RANGE_SAMPLE_SIZE (1024 * 1024)
+
+/* Size of the sample for range partitioning (set through -S range=size) */
+static size_t range_sample = RANGE_SAMPLE_SIZE;
+
+/* A copy of a record without its terminator, followed by a NUL */
+struct record {
+	char *p;
+	size_t len;
+};
+
+/*
+ * Records separating the key ranges of successive partitions (-S range);
+ * a record goes to the partition following the last splitter that is
+ * not greater than it.
+ */
+static struct record *splitters;
+static int nsplitters;
+static bool splitters_chosen;
+
+/*
+ * Tag scattered chunks with sequence numbers (set through -q),
+ * so that their order can be restored with -g seq.
+ * A tag is a record starting with SEQ_TAG followed by the decimal number.
+ */
+static bool opt_seq_tags = false;
+#define SEQ_TAG '\036'		/* ASCII record separator */
+#define SEQ_TAG_SIZE 24		/* Maximum size of a tag record */
+
+/* Sequence number of the next scattered chunk */
+static long long scatter_seq;
+
+/* Sequence number of the next chunk to gather */
+static long long gather_seq;
+
 /* Use a temporary file for overflowing buffered data */
 static bool use_tmp_file = false;
 
+/* Compress the data written to the temporary file (set through -C) */
+static bool opt_compress = false;
+
 /* User-specified temporary directory */
 static char *opt_tmp_dir = NULL;
 
 /*
- * Split scattered data on blocks of specified size; otherwise on line boundaries
- * Currently there is no support for this option; a -l option should be added.
+ * Split scattered data on blocks of specified size (set through -l);
+ * otherwise on line boundaries
  */
+static size_t block_len = 0;
+
+/* The input file whose data is currently scattered */
+static struct source_info *scatter_ifp = NULL;
+
+/* Time at which processing started */
+static double start_time;
+
+/* Pipe through which a SIGUSR1 handler notifies the event loop */
+static int stats_notify[2] = {-1, -1};
 
-static bool block_len = 0;
+/* True if the event loop has been asked to output live statistics */
+static bool stats_ready;
 
 /* Set to true when we reach EOF on input */
 static bool reached_eof = false;
@@ -161,6 +426,44 @@ struct sink_info {
 	struct source_info *ifp;/* Input file we read from */
 	bool chain_last;	/* True if last element in a group; Writing  (copy or scatter)
 				   should not continue to next element */
+	bool is_pipe;		/* True if the output is a pipe (zero-copy eligible) */
+	bool wait;		/* True if the event loop waits for writing to it */
+	bool ready;		/* True if it can be written without blocking */
+	/* Scatter accounting */
+	off_t bytes_written;	/* Total number of bytes written */
+	double drain_rate;	/* Moving average of the rate the sink's reader
+				   consumes data (bytes/s); 0 if unknown */
+	double drain_time;	/* Time of the last drain rate sample */
+	off_t drain_consumed;	/* Bytes consumed at the last sample */
+	off_t drain_backlog;	/* Bytes waiting to be consumed at the last sample */
+	double scatter_weight;	/* Weight of the sink's part in the scattered data */
+	size_t scatter_share;	/* Units of scattered data to assign to the sink */
+	/* Statistics */
+	double time_blocked;	/* Total time data could not be written (s) */
+	double blocked_since;	/* Time writing last blocked; 0 if not blocked */
+	int writer;		/* Writer thread writing to the sink (-j) */
+	char tag[SEQ_TAG_SIZE];	/* Sequence tag to write before the data (-q) */
+	size_t tag_len;		/* Length of the tag */
+	size_t tag_written;	/* Part of the tag already written */
+	/* Lossy delivery (-L) */
+	enum output_policy policy;
+	unsigned long policy_arg;	/* Sampling period or byte rate */
+	bool record_skip;	/* Drop the data up to the next record terminator */
+	char *held;		/* Rest of a record kept when the sink lagged */
+	size_t held_size;	/* Allocated size of held */
+	size_t held_len;	/* Length of the held data */
+	size_t held_written;	/* Part of the held data already written */
+	int pipe_size;		/* Capacity of the output pipe; 0 if unknown (-P) */
+	long long writes;	/* Number of write system calls */
+	enum {
+		fc_none,	/* Write the data from memory */
+		fc_copy_range,	/* Copy mapped source data with copy_file_range(2) */
+		fc_sendfile	/* Copy mapped source data with sendfile(2) */
+	} file_copy;		/* How a regular file sink copies file data */
+	unsigned long records_seen;	/* Records considered for sampling */
+	double rate_allowance;	/* Bytes that can be written under the rate limit */
+	double rate_time;	/* Time the allowance was last replenished */
+	off_t bytes_dropped;	/* Total number of bytes dropped */
 };
 
 /* Construct a new sink_info object */
@@ -174,6 +477,25 @@ new_sink_info(const char *name)
 	ofp->name = name ? strdup(name) : NULL;
 	ofp->active = true;
 	ofp->pos_written = ofp->pos_to_write = 0;
+	ofp->is_pipe = false;
+	ofp->wait = ofp->ready = false;
+	ofp->bytes_written = 0;
+	ofp->drain_rate = ofp->drain_time = 0;
+	ofp->drain_consumed = ofp->drain_backlog = 0;
+	ofp->time_blocked = ofp->blocked_since = 0;
+	ofp->writer = 0;
+	ofp->tag_len = ofp->tag_written = 0;
+	ofp->policy = op_all;
+	ofp->policy_arg = 0;
+	ofp->record_skip = false;
+	ofp->held = NULL;
+	ofp->held_size = ofp->held_len = ofp->held_written = 0;
+	ofp->pipe_size = 0;
+	ofp->writes = 0;
+	ofp->file_copy = fc_none;
+	ofp->records_seen = 0;
+	ofp->rate_allowance = ofp->rate_time = 0;
+	ofp->bytes_dropped = 0;
 	ofp->next = NULL;
 	return ofp;
 }
@@ -192,8 +514,35 @@ struct source_info {
 	bool is_read;			/* True if an active sink reads it */
 	bool chain_last;		/* True if reading should stop at this element rather
 					   than continue to the next element */
+	bool is_pipe;			/* True if the input is a pipe (zero-copy eligible) */
+	bool wait;			/* True if the event loop waits for reading from it */
+	bool ready;			/* True if it can be read without blocking */
+	off_t *writer_min;		/* Minimum position written by each writer
+					   thread's active sinks; -1 if none (-j) */
+	/* Merging (-g merge) and partitioning (-S hash) */
+	off_t merge_pos;		/* Position of the first record not merged */
+	off_t merge_scanned;		/* Position up to which no terminator was found */
+	char *head;			/* Copy of the record at merge_pos */
+	size_t head_len;		/* Length of the record including its terminator */
+	size_t head_size;		/* Allocated size of head */
+	int ordinal;			/* Order among the inputs */
+	bool merge_needed;		/* True if gathering waits for the next record */
+	long long chunk_seq;		/* Sequence number of the chunk at merge_pos;
+					   -1 if a tag is expected (-g seq) */
+	off_t seq_data_end;		/* Position up to which data belong to that chunk */
+	/* I/O sizes */
+	int pipe_size;			/* Capacity of the input pipe; 0 if unknown (-P) */
+	double read_avg;		/* Moving average of the bytes read (-P) */
+	long long reads;		/* Number of read system calls */
+	/* Regular files */
+	char *map;			/* Mapping of the data; NULL if not mapped */
+	size_t map_size;		/* Length of the mapped data */
+	off_t map_offset;		/* File offset of the mapped data */
 };
 
+/* True if the event loop waits for and can perform I/O on a source or sink */
+#define fp_ready(fp) ((fp)->wait && (fp)->ready)
+
 /* Return the name of a source or sink */
 #define fp_name(fp) ((fp)->name ? (fp)->name : fd_name((fp)->fd))
 static char *
@@ -219,6 +568,22 @@ new_source_info(const char *name)
 	ifp->bp = new_buffer_pool();
 	ifp->source_pos_read = 0;
 	ifp->reached_eof = false;
+	ifp->is_pipe = false;
+	ifp->wait = ifp->ready = false;
+	ifp->writer_min = NULL;
+	ifp->merge_pos = ifp->merge_scanned = 0;
+	ifp->head = NULL;
+	ifp->head_len = ifp->head_size = 0;
+	ifp->ordinal = 0;
+	ifp->merge_needed = false;
+	ifp->chunk_seq = -1;
+	ifp->seq_data_end = 0;
+	ifp->pipe_size = 0;
+	ifp->read_avg = 0;
+	ifp->reads = 0;
+	ifp->map = NULL;
+	ifp->map_size = 0;
+	ifp->map_offset = 0;
 	ifp->next = NULL;
 	return ifp;
 }
@@ -233,12 +598,12 @@ new_source_info(const char *name)
  * active output buffer is empty.
  * The setting in effect is determined by the program's -I flag.
  *
- * States read_ib and read_ob have select return:
+ * States read_ib and read_ob have the event loop return:
  * - if data is available for reading,
  * - if the process can write out data already read,
  * - not if the process can write to other fds
  *
- * States drain_ib and write_ob have select return
+ * States drain_ib and write_ob have the event loop return
  * if the process can write to any fd.
  * Waiting on all output buffers (not only those with data)
  * is needed to avoid starvation of downstream processes
@@ -246,7 +611,7 @@ new_source_info(const char *name)
  * If a program can accept data this process will then transition to
  * read_* to read more data.
  *
- * State drain_ob has select return only if the process can write out
+ * State drain_ob has the event loop return only if the process can write out
  * data already read.
  *
  * See also the diagram tee-state.dot
@@ -259,532 +624,3780 @@ enum state {
 	write_ob,		/* Write data, before reading */
 };
 
-/*
- * Return the total number of bytes required for storing all buffers
- * up to the specified memory pool
- */
-static unsigned long
-memory_pool_size(struct buffer_pool *bp, int pool)
+/* Return the current time in seconds from an arbitrary point */
+static double
+time_now(void)
 {
-	return ((bp->buffers_allocated - bp->buffers_freed) + (pool - bp->allocated_pool_end + 1)) * buffer_size;
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		err(2, "Error getting the time");
+	return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-/* Write half of the allocated buffer pool to the temporary file */
+/*
+ * Account for the start or the end of a period during which the sink
+ * cannot receive data
+ */
 static void
-page_out(struct buffer_pool *bp)
+sink_blocked(struct sink_info *ofp, bool blocked)
 {
-	if (bp->page_file_fd == -1) {
-		char *template;
-
-		/*
-		 * Create a temporary file that will be deleted on exit.
-		 * The location follows tempnam rules (argument, TMPDIR,
-		 * P_tmpdir, /tmp), while the creation through mkstemp
-		 * avoids race conditions.
-		 */
-		if ((template = tempnam(opt_tmp_dir, "sg-")) == NULL)
-			err(1, "Unable to obtain temporary file name");
-		if ((template = realloc(template, strlen(template) + 7)) == NULL)
-			err(1, "Error obtaining temporary file name space");
-		strcat(template, "XXXXXX");
-		if ((bp->page_file_fd = mkstemp(template)) == -1)
-			err(1, "Unable to create temporary file %s", template);
+	if (blocked && ofp->blocked_since == 0)
+		ofp->blocked_since = time_now();
+	else if (!blocked && ofp->blocked_since != 0) {
+		ofp->time_blocked += time_now() - ofp->blocked_since;
+		ofp->blocked_since = 0;
 	}
+}
 
-	/*
-	 * Page-out memory buffers from the pool, round-robin fashion,
-	 * starting from the oldest buffers.
-	 * This is good enough for the simple common case where one output fd is blocked.
-	 */
-	while (memory_pool_size(bp, bp->allocated_pool_end - 1) > max_mem / 2) {
-		switch (bp->buffers[bp->page_out_ptr].s) {
-		case s_memory:
-			if (pwrite(bp->page_file_fd, bp->buffers[bp->page_out_ptr].p, buffer_size, (off_t)bp->page_out_ptr * buffer_size) != buffer_size)
-				err(1, "Write to temporary file failed");
-			/* FALLTHROUGH */
-		case s_memory_backed:
-			DPRINTF(4, "Page out buffer %d %p", bp->page_out_ptr, bp->buffers[bp->page_out_ptr].p);
-			bp->buffers[bp->page_out_ptr].s = s_file;
-			free(bp->buffers[bp->page_out_ptr].p);
-			bp->buffers_freed++;
-			bp->buffers_paged_out++;
-			DPRINTF(4, "Paged out buffer %d %p", bp->page_out_ptr, bp->buffers[bp->page_out_ptr].p);
-			break;
-		case s_file:
-		case s_none:
-			break;
-		default:
-			assert(false);
-		}
-		if (++bp->page_out_ptr == bp->allocated_pool_end)
-			bp->page_out_ptr = 0;
-	}
+/* Allocate new memory for a pool buffer; return NULL if none is available. */
+static void *
+buffer_new(void)
+{
+	void *p;
+
+	if (!opt_huge_pages)
+		return malloc(buffer_size);
+#ifdef MAP_HUGETLB
+	/* Reserved huge pages; only usable for whole pages */
+	if (buffer_size % HUGE_PAGE_SIZE == 0 &&
+	    (p = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0)) != MAP_FAILED)
+		return p;
+#endif
+	if ((p = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	/* Transparent huge pages; best effort */
+	(void)madvise(p, buffer_size, MADV_HUGEPAGE);
+#endif
+	return p;
 }
 
 /*
- * Allocate memory for the specified pool member.
- * Return false if no such memory is available.
+ * Return the start time of the specified process, which together with
+ * its pid identifies it, or 0 if this is not known or the process
+ * has terminated, but has not yet been waited for.
  */
-static bool
-allocate_pool_buffer(struct buffer_pool *bp, int pool)
+static unsigned long long
+process_start_time(pid_t pid)
 {
-	struct pool_buffer *b = &bp->buffers[pool];
+	unsigned long long start = 0;
+#ifdef __linux__
+	char name[64], buff[1024], *p;
+	size_t n;
+	FILE *f;
+	int i;
 
-	if ((b->p = malloc(buffer_size)) == NULL) {
-		DPRINTF(4, "Unable to allocate %d bytes for buffer %ld", buffer_size, b - bp->buffers);
-		bp->max_buffers_allocated = MAX(bp->buffers_allocated - bp->buffers_freed, bp->max_buffers_allocated);
-		return false;
-	}
-	b->s = s_memory;
-	DPRINTF(4, "Allocated buffer %ld to %p", b - bp->buffers, b->p);
-	bp->buffers_allocated++;
-	bp->max_buffers_allocated = MAX(bp->buffers_allocated - bp->buffers_freed, bp->max_buffers_allocated);
-	return true;
+	snprintf(name, sizeof(name), "/proc/%ld/stat", (long)pid);
+	if ((f = fopen(name, "r")) == NULL)
+		return 0;
+	n = fread(buff, 1, sizeof(buff) - 1, f);
+	(void)fclose(f);
+	buff[n] = '\0';
+	/* The state is the 3rd field and the start time the 22nd one. */
+	p = strrchr(buff, ')');
+	if (p == NULL || p[1] != ' ' || p[2] == 'Z' || p[2] == 'X')
+		return 0;
+	for (i = 0; p && i < 20; i++)
+		p = strchr(p + 1, ' ');
+	if (p == NULL || sscanf(p, "%llu", &start) != 1)
+		return 0;
+#endif
+	return start;
 }
 
+/* Return true if the specified graph user's process has terminated */
+static bool
+graph_user_gone(pid_t pid, unsigned long long start)
+{
+	if (kill(pid, 0) == -1 && errno == ESRCH)
+		return true;
+	return start != 0 && process_start_time(pid) != start;
+}
 
 /*
- * Ensure that the specified pool buffer is in memory
+ * Return to the graph's memory budget the memory held by tees
+ * that terminated without detaching from it.
  */
 static void
-page_in(struct buffer_pool *bp, int pool)
+graph_reclaim(void)
 {
-	struct pool_buffer *b = &bp->buffers[pool];
+	struct graph_user *u;
+	int pid;
 
-	switch (b->s) {
-	case s_memory_backed:
-	case s_memory:
-		break;
-	case s_file:
-		/* Good time to ensure that there will be page-in memory available */
-		if (memory_pool_size(bp, bp->allocated_pool_end - 1) > max_mem)
-			page_out(bp);
-		if (!allocate_pool_buffer(bp, pool))
-			err(1, "Out of memory paging-in buffer");
-		if (pread(bp->page_file_fd, b->p, buffer_size, (off_t)pool * buffer_size) != buffer_size)
-			err(1, "Read from temporary file failed");
-		bp->buffers_paged_in++;
-		b->s = s_memory_backed;
-		DPRINTF(4, "Page in buffer %d", pool);
-		break;
-	case s_none:
-	default:
-		DPRINTF(4, "Buffer %d has invalid storage %d", pool, b->s);
-		assert(false);
-		break;
+	for (u = graph_memory->user; u < graph_memory->user + GRAPH_USERS; u++) {
+		pid = atomic_load(&u->pid);
+		if (pid <= 0 || u == graph_user || !graph_user_gone(pid, u->start))
+			continue;
+		if (!atomic_compare_exchange_strong(&u->pid, &pid, -1))
+			continue;
+		DPRINTF(2, "Reclaiming %ld bytes of terminated tee %d",
+			(long)atomic_load(&u->held), pid);
+		atomic_fetch_sub(&graph_memory->used, atomic_exchange(&u->held, 0));
+		atomic_fetch_sub(&graph_memory->users, 1);
+		atomic_store(&u->pid, 0);
 	}
-
 }
 
 /*
- * Allocate memory for the specified pool
- * If we're out of memory by reaching the user-specified limit
- * or a system's hard limit return false.
- * If sufficient memory is available return true.
- * buffers[pool] will then point to a buffer_size block of available memory.
+ * Reserve the memory of a buffer from the graph's memory budget.
+ * Essential buffers, without which the tee cannot make progress,
+ * are reserved even if this exceeds the budget.
+ * Return false if the budget is exhausted.
  */
 static bool
-memory_allocate(struct buffer_pool *bp, int pool)
+graph_reserve(bool essential)
 {
-	int i, orig_pool_size;
-	struct pool_buffer *orig_buffers;
+	static double reclaimed;
+	double now;
 
-	if (pool < bp->allocated_pool_end)
+	if (graph_memory == NULL)
 		return true;
-
-	DPRINTF(4, "Buffers allocated: %d Freed: %d", bp->buffers_allocated, bp->buffers_freed);
-	/* Check soft memory limit through allocated plus requested memory. */
-	if (memory_pool_size(bp, pool) > max_mem) {
-		if (use_tmp_file)
-			page_out(bp);
-		else
+	if ((unsigned long)atomic_fetch_add(&graph_memory->used, buffer_size) +
+	    buffer_size > graph_limit && !essential) {
+		atomic_fetch_sub(&graph_memory->used, buffer_size);
+		/* Try again after reclaiming the memory of killed tees. */
+		if ((now = time_now()) - reclaimed < GRAPH_RECLAIM_INTERVAL)
 			return false;
-	}
-
-	/* Keep original values to undo on failure. */
-	orig_pool_size = bp->pool_size;
-	orig_buffers = bp->buffers;
-	/* Resize bank, if needed. One iteration should suffice. */
-	while (pool >= bp->pool_size) {
-		if (bp->pool_size == 0)
-			bp->pool_size = 1;
-		else
-			bp->pool_size *= 2;
-		if ((bp->buffers = realloc(bp->buffers, bp->pool_size * sizeof(struct pool_buffer))) == NULL) {
-			DPRINTF(4, "Unable to reallocate buffer pool bank");
-			bp->pool_size = orig_pool_size;
-			bp->buffers = orig_buffers;
+		reclaimed = now;
+		graph_reclaim();
+		if ((unsigned long)atomic_fetch_add(&graph_memory->used, buffer_size) +
+		    buffer_size > graph_limit) {
+			atomic_fetch_sub(&graph_memory->used, buffer_size);
 			return false;
 		}
 	}
-
-	/* Allocate buffer memory [allocated_pool_end, pool]. */
-	for (i = bp->allocated_pool_end; i <= pool; i++)
-		if (!allocate_pool_buffer(bp, i)) {
-			bp->allocated_pool_end = i;
-			return false;
-		}
-	bp->allocated_pool_end = pool + 1;
+	graph_held += buffer_size;
+	if (graph_user)
+		atomic_fetch_add(&graph_user->held, buffer_size);
 	return true;
 }
 
+/* Return the specified number of bytes to the graph's memory budget. */
+static void
+graph_release(unsigned long n)
+{
+	if (graph_memory == NULL)
+		return;
+	atomic_fetch_sub(&graph_memory->used, n);
+	graph_held -= n;
+	if (graph_user)
+		atomic_fetch_sub(&graph_user->held, n);
+}
+
 /*
- * Free a file-backed buffer at the specified pool location
- * by punching a hole to the file. This is a best effort
- * operation, as it is only supported on Linux.
+ * Return true if the specified number of buffers can be obtained
+ * within the graph's memory budget.
  */
-static void
-buffer_file_free(struct buffer_pool *bp, int pool)
+static bool
+graph_available(int n)
 {
-#ifdef FALLOC_FL_PUNCH_HOLE
-	static bool warned = false;
+	n -= free_buffers_n;
+	return graph_memory == NULL || n <= 0 ||
+		(unsigned long)atomic_load(&graph_memory->used) +
+		(unsigned long)n * buffer_size <= graph_limit;
+}
 
-	if (fallocate(bp->page_file_fd, FALLOC_FL_PUNCH_HOLE, pool * buffer_size, buffer_size) < 0 &&
-	    !warned) {
-		warn("Failed to free temporary buffer space");
-		warned = true;
+/*
+ * Obtain memory for a buffer of the specified pool,
+ * reusing a freed buffer if one is available.
+ * Return NULL if no memory is available.
+ */
+static void *
+buffer_get(struct buffer_pool *bp, bool essential)
+{
+	void *p;
+
+	if (free_buffers_n > 0) {
+		p = free_buffers[--free_buffers_n];
+		bp->buffers_reused++;
+	} else {
+		if (!graph_reserve(essential))
+			return NULL;
+		if ((p = buffer_new()) == NULL) {
+			graph_release(buffer_size);
+			return NULL;
+		}
 	}
-#endif
-	bp->pages_freed++;
+	buffers_in_use++;
+	return p;
 }
 
 /*
- * Ensure that pool buffers from [0,pos) are free.
+ * Release the memory of a pool buffer, keeping it for reuse
+ * if this does not exceed the maximum memory size
+ * or, for a shared budget, the few buffers kept by each tee.
  */
 static void
-memory_free(struct buffer_pool *bp, off_t pos)
+buffer_put(void *p)
 {
-	int pool_end = pos / buffer_size;
-	int i;
-
-	DPRINTF(4, "memory_free: pool=%p pos = %ld, begin=%d end=%d",
-		bp, (long)pos, bp->free_pool_begin, pool_end);
-	for (i = bp->free_pool_begin; i < pool_end; i++) {
-		switch (bp->buffers[i].s) {
-		case s_memory:
-			free(bp->buffers[i].p);
-			bp->buffers_freed++;
-			break;
-		case s_file:
-			buffer_file_free(bp, i);
-			break;
-		case s_memory_backed:
-			buffer_file_free(bp, i);
-			free(bp->buffers[i].p);
-			bp->buffers_freed++;
-			break;
-		case s_none:
-			break;
-		default:
-			assert(false);
-			break;
+	buffers_in_use--;
+	if ((unsigned long)(buffers_in_use + free_buffers_n + 1) * buffer_size <= max_mem &&
+	    (graph_memory == NULL || free_buffers_n < GRAPH_FREE_BUFFERS)) {
+		if (free_buffers_n == free_buffers_size) {
+			free_buffers_size = free_buffers_size ? free_buffers_size * 2 : 16;
+			if ((free_buffers = realloc(free_buffers,
+			    free_buffers_size * sizeof(*free_buffers))) == NULL)
+				err(1, NULL);
 		}
-		bp->buffers[i].s = s_none;
-		DPRINTF(4, "Freed buffer %d %p (pos = %ld, begin=%d end=%d)",
-			i, bp->buffers[i].p, (long)pos, bp->free_pool_begin, pool_end);
-		#ifdef DEBUG
-		bp->buffers[i].p = NULL;
-		#endif
+		free_buffers[free_buffers_n++] = p;
+		return;
 	}
-	bp->free_pool_begin = pool_end;
+	if (opt_huge_pages)
+		(void)munmap(p, buffer_size);
+	else
+		free(p);
+	graph_release(buffer_size);
 }
 
 /*
- * Set the buffer to write to for reading from a file from
- * position onward, ensuring that sufficient memory is allocated.
- * Return false if no memory is available.
+ * Temporary file I/O is performed asynchronously by a helper thread,
+ * so that paging buffers out and in does not stall the writing of
+ * data to the sinks that keep up.
+ * Completed jobs are collected by the event loop, which is notified
+ * through a pipe.
  */
-static bool
-source_buffer(struct source_info *ifp, /* OUT */ struct io_buffer *b)
-{
-	int pool = ifp->source_pos_read / buffer_size;
-	size_t pool_offset = ifp->source_pos_read % buffer_size;
+struct page_job {
+	struct page_job *next;		/* Next list element */
+	struct buffer_pool *bp;		/* Pool of the buffer */
+	int pool;			/* Buffer's pool index */
+	int fd;				/* Temporary file */
+	void *p;			/* Buffer memory */
+	bool write;			/* True for paging out, false for paging in */
+	off_t offset;			/* Temporary file extent; set by the */
+	size_t length;			/* paging thread when writing */
+	const char *error;		/* Failure message, set by the */
+	int error_no;			/* paging thread with its errno */
+};
 
-	if (!memory_allocate(ifp->bp, pool))
-		return false;
-	if (ifp->bp->buffers[pool].s != s_memory)
-		DPRINTF(4, "ifp->bp->buffers[pool].s = 0x%x, pool=%d\n", ifp->bp->buffers[pool].s, pool);
-	assert(ifp->bp->buffers[pool].s == s_memory);
-	b->p = ifp->bp->buffers[pool].p + pool_offset;
-	b->size = buffer_size - pool_offset;
-	DPRINTF(4, "Source buffer(%ld) returns pool %d(%p) o=%ld l=%ld a=%p",
-		(long)ifp->source_pos_read, pool, ifp->bp->buffers[pool].p, (long)pool_offset, (long)b->size, b->p);
+/* Queued and completed jobs; protected by page_mutex */
+static pthread_mutex_t page_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t page_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t page_completed = PTHREAD_COND_INITIALIZER;
+static struct page_job *page_queue, **page_queue_end = &page_queue;
+static struct page_job *page_done;
+
+/* Jobs submitted and not yet collected by the event loop */
+static int page_jobs;
+
+/* Pipe through which the helper thread notifies the event loop */
+static int page_notify[2] = {-1, -1};
+
+/* True if the event loop has been notified of completed jobs */
+static bool page_ready;
+
+/* Number of buffers to read ahead of a sink's paged-in data */
+#define PAGE_READ_AHEAD 4
+
+/* The sinks, whose write positions determine the buffers to page out */
+static struct sink_info *page_sinks;
+
+/*
+ * Compressed extents are appended to the temporary file at multiples
+ * of the file system block size, so that punching a hole in a freed
+ * extent releases its disk space.
+ */
+#define PAGE_FILE_BLOCK 4096
+
+/* Compressed data scratch space of the paging thread */
+static char *page_compressed;
+
+/*
+ * Write the buffer of the specified job to the temporary file,
+ * compressed if this is enabled and it saves space, and set the
+ * job's file extent.
+ * Return NULL on success or a message describing the failure.
+ */
+static const char *
+page_write(struct page_job *j)
+{
+	const void *data = j->p;
+	size_t len = buffer_size;
+
+	if (opt_compress) {
+		len = dgsh_compress(j->p, buffer_size, page_compressed, buffer_size - 1);
+		if (len)
+			data = page_compressed;
+		else
+			len = buffer_size;
+		j->offset = j->bp->page_file_end;
+		j->bp->page_file_end += (len + PAGE_FILE_BLOCK - 1) /
+			PAGE_FILE_BLOCK * PAGE_FILE_BLOCK;
+	} else
+		j->offset = (off_t)j->pool * buffer_size;
+	j->length = len;
+	if (pwrite(j->fd, data, len, j->offset) != (ssize_t)len)
+		return "Write to temporary file failed";
+	return NULL;
+}
+
+/*
+ * Read the buffer of the specified job from its temporary file extent.
+ * Return NULL on success or a message describing the failure.
+ */
+static const char *
+page_read(struct page_job *j)
+{
+	if (j->length == (size_t)buffer_size) {
+		if (pread(j->fd, j->p, buffer_size, j->offset) != buffer_size)
+			return "Read from temporary file failed";
+		return NULL;
+	}
+	if (pread(j->fd, page_compressed, j->length, j->offset) != (ssize_t)j->length)
+		return "Read from temporary file failed";
+	if (dgsh_decompress(page_compressed, j->length, j->p, buffer_size) != buffer_size) {
+		errno = 0;
+		return "Corrupt compressed data in temporary file";
+	}
+	return NULL;
+}
+
+/*
+ * Perform the queued temporary file I/O jobs.
+ * Failures are recorded in the job and reported by the event loop,
+ * so that the program exits from its main thread.
+ */
+static void *
+page_worker(void *arg)
+{
+	struct page_job *j;
+
+	for (;;) {
+		pthread_mutex_lock(&page_mutex);
+		while (page_queue == NULL)
+			pthread_cond_wait(&page_queued, &page_mutex);
+		j = page_queue;
+		if ((page_queue = j->next) == NULL)
+			page_queue_end = &page_queue;
+		pthread_mutex_unlock(&page_mutex);
+
+		errno = 0;
+		j->error = j->write ? page_write(j) : page_read(j);
+		j->error_no = errno;
+
+		pthread_mutex_lock(&page_mutex);
+		j->next = page_done;
+		page_done = j;
+		pthread_cond_signal(&page_completed);
+		pthread_mutex_unlock(&page_mutex);
+		/* A full pipe already carries a notification. */
+		(void)write(page_notify[1], "", 1);
+	}
+	/* NOTREACHED */
+	return NULL;
+}
+
+/* Queue a job to write or read the specified buffer */
+static void
+page_submit(struct buffer_pool *bp, int pool, bool write)
+{
+	struct page_job *j;
+
+	if ((j = malloc(sizeof(struct page_job))) == NULL)
+		err(1, NULL);
+	j->bp = bp;
+	j->pool = pool;
+	j->fd = bp->page_file_fd;
+	j->p = bp->buffers[pool].p;
+	j->write = write;
+	j->offset = bp->buffers[pool].file_offset;
+	j->length = bp->buffers[pool].file_length;
+	j->next = NULL;
+	page_jobs++;
+
+	pthread_mutex_lock(&page_mutex);
+	*page_queue_end = j;
+	page_queue_end = &j->next;
+	pthread_cond_signal(&page_queued);
+	pthread_mutex_unlock(&page_mutex);
+}
+
+/*
+ * Collect the completed temporary file I/O jobs, updating the state
+ * of their buffers.
+ */
+static void
+page_complete(void)
+{
+	struct page_job *j, *next;
+	struct pool_buffer *b;
+	char drain[64];
+
+	while (read(page_notify[0], drain, sizeof(drain)) > 0)
+		;
+	page_ready = false;
+
+	pthread_mutex_lock(&page_mutex);
+	j = page_done;
+	page_done = NULL;
+	pthread_mutex_unlock(&page_mutex);
+
+	for (; j; j = next) {
+		next = j->next;
+		if (j->error) {
+			if ((errno = j->error_no) != 0)
+				err(1, "%s", j->error);
+			errx(1, "%s", j->error);
+		}
+		b = &j->bp->buffers[j->pool];
+		if (j->write) {
+			assert(b->s == s_paging_out);
+			b->s = s_file;
+			b->file_offset = j->offset;
+			b->file_length = j->length;
+			j->bp->bytes_spilled += buffer_size;
+			j->bp->bytes_stored += j->length;
+			buffer_put(b->p);
+			j->bp->buffers_freed++;
+			j->bp->buffers_paged_out++;
+			j->bp->buffers_paging_out--;
+			DPRINTF(4, "Paged out buffer %d", j->pool);
+		} else {
+			assert(b->s == s_paging_in);
+			b->s = s_memory_backed;
+			j->bp->buffers_paged_in++;
+			DPRINTF(4, "Paged in buffer %d", j->pool);
+		}
+		page_jobs--;
+		free(j);
+	}
+}
+
+/* Wait until the specified buffer is no longer being paged */
+static void
+page_wait(struct buffer_pool *bp, int pool)
+{
+	while (bp->buffers[pool].s == s_paging_out ||
+	    bp->buffers[pool].s == s_paging_in) {
+		pthread_mutex_lock(&page_mutex);
+		while (page_done == NULL)
+			pthread_cond_wait(&page_completed, &page_mutex);
+		pthread_mutex_unlock(&page_mutex);
+		page_complete();
+	}
+}
+
+/* Wait until some paging job completes; return false if none is pending */
+static bool
+page_wait_any(void)
+{
+	if (page_jobs == 0)
+		return false;
+	pthread_mutex_lock(&page_mutex);
+	while (page_done == NULL)
+		pthread_cond_wait(&page_completed, &page_mutex);
+	pthread_mutex_unlock(&page_mutex);
+	page_complete();
+	return true;
+}
+
+/*
+ * Return the total number of bytes required for storing all buffers
+ * up to the specified memory pool
+ */
+static unsigned long
+memory_pool_size(struct buffer_pool *bp, int pool)
+{
+	return ((bp->buffers_allocated - bp->buffers_freed) + (pool - bp->allocated_pool_end + 1)) * buffer_size;
+}
+
+/* A region of pool buffers that will next be needed by the same sinks */
+struct page_region {
+	int start;		/* First buffer */
+	int length;		/* Number of buffers */
+};
+
+/* Order regions by ascending start; qsort(3) helper */
+static int
+region_start_compare(const void *a, const void *b)
+{
+	return ((const struct page_region *)a)->start -
+		((const struct page_region *)b)->start;
+}
+
+/* Order regions by descending length; qsort(3) helper */
+static int
+region_length_compare(const void *a, const void *b)
+{
+	return ((const struct page_region *)b)->length -
+		((const struct page_region *)a)->length;
+}
+
+/*
+ * Page-out the specified buffer, if it is in memory.
+ * Buffers that are not yet written to the temporary file are
+ * queued for writing, and freed when this completes.
+ * The last buffer, which is being filled, is never paged out.
+ */
+static void
+page_out_buffer(struct buffer_pool *bp, int pool)
+{
+	struct pool_buffer *b = &bp->buffers[pool];
+
+	switch (b->s) {
+	case s_memory:
+		if (pool == bp->allocated_pool_end - 1)
+			break;
+		DPRINTF(4, "Page out buffer %d %p", pool, b->p);
+		b->s = s_paging_out;
+		bp->buffers_paging_out++;
+		page_submit(bp, pool, true);
+		break;
+	case s_memory_backed:
+		DPRINTF(4, "Page out buffer %d %p", pool, b->p);
+		b->s = s_file;
+		buffer_put(b->p);
+		bp->buffers_freed++;
+		bp->buffers_paged_out++;
+		DPRINTF(4, "Paged out buffer %d", pool);
+		break;
+	case s_file:
+	case s_none:
+	case s_paging_out:
+	case s_paging_in:
+	case s_mapped:
+		break;
+	default:
+		assert(false);
+	}
+}
+
+/*
+ * Page-out buffers to the temporary file, until the memory used
+ * by the pool (excluding buffers being written) is at most target.
+ */
+static void
+page_out(struct buffer_pool *bp, unsigned long target)
+{
+	static struct page_region *region;
+	static int region_size;
+	struct sink_info *ofp;
+	int i, nregion, distance;
+
+	if (bp->page_file_fd == -1) {
+		char *template;
+
+		/*
+		 * Create a temporary file that will be deleted on exit.
+		 * The location follows tempnam rules (argument, TMPDIR,
+		 * P_tmpdir, /tmp), while the creation through mkstemp
+		 * avoids race conditions.
+		 */
+		if ((template = tempnam(opt_tmp_dir, "sg-")) == NULL)
+			err(1, "Unable to obtain temporary file name");
+		if ((template = realloc(template, strlen(template) + 7)) == NULL)
+			err(1, "Error obtaining temporary file name space");
+		strcat(template, "XXXXXX");
+		if ((bp->page_file_fd = mkstemp(template)) == -1)
+			err(1, "Unable to create temporary file %s", template);
+	}
+
+	/*
+	 * Page-out the buffers that will be needed last.
+	 * The sinks' write positions divide the pool into regions;
+	 * the buffers of each region will next be needed by the sinks
+	 * at its start, such as the slowest sinks for the region up to
+	 * the next sinks.
+	 * Buffers are paged out in order of decreasing distance from
+	 * the start of their region, so that the data near any sink's
+	 * write position are the last to be paged out.
+	 */
+	nregion = 0;
+	for (ofp = page_sinks; ofp; ofp = ofp->next) {
+		if (!ofp->active || ofp->ifp->bp != bp)
+			continue;
+		if (nregion == region_size) {
+			region_size = region_size ? region_size * 2 : 16;
+			if ((region = realloc(region, (region_size + 1) * sizeof(*region))) == NULL)
+				err(1, NULL);
+		}
+		region[nregion++].start = ofp->pos_written / buffer_size;
+	}
+	if (nregion == 0) {
+		/* No sink is writing this pool's data; treat it as a single region */
+		if (region_size == 0) {
+			region_size = 1;
+			if ((region = malloc((region_size + 1) * sizeof(*region))) == NULL)
+				err(1, NULL);
+		}
+		region[nregion++].start = bp->free_pool_begin;
+	}
+	qsort(region, nregion, sizeof(*region), region_start_compare);
+	region[nregion].start = bp->allocated_pool_end;
+	for (i = 0; i < nregion; i++) {
+		region[i].start = MAX(region[i].start, bp->free_pool_begin);
+		region[i].length = MAX(region[i + 1].start - region[i].start, 0);
+	}
+	qsort(region, nregion, sizeof(*region), region_length_compare);
+
+	for (distance = region[0].length - 1; distance >= 0; distance--)
+		for (i = 0; i < nregion && region[i].length > distance; i++) {
+			if (memory_pool_size(bp, bp->allocated_pool_end - 1) -
+			    (unsigned long)bp->buffers_paging_out * buffer_size <= target)
+				return;
+			page_out_buffer(bp, region[i].start + distance);
+		}
+}
+
+/*
+ * Allocate memory for the specified pool member.
+ * Essential members are allocated even beyond the graph's memory budget.
+ * Return false if no such memory is available.
+ */
+static bool
+allocate_pool_buffer(struct buffer_pool *bp, int pool, bool essential)
+{
+	struct pool_buffer *b = &bp->buffers[pool];
+
+	if ((b->p = buffer_get(bp, essential)) == NULL) {
+		DPRINTF(4, "Unable to allocate %d bytes for buffer %ld", buffer_size, b - bp->buffers);
+		bp->max_buffers_allocated = MAX(bp->buffers_allocated - bp->buffers_freed, bp->max_buffers_allocated);
+		return false;
+	}
+	b->s = s_memory;
+	DPRINTF(4, "Allocated buffer %ld to %p", b - bp->buffers, b->p);
+	bp->buffers_allocated++;
+	bp->max_buffers_allocated = MAX(bp->buffers_allocated - bp->buffers_freed, bp->max_buffers_allocated);
+	return true;
+}
+
+
+/*
+ * Start bringing the specified pool buffer, which is stored in the
+ * temporary file, into memory.
+ */
+static void
+page_in_start(struct buffer_pool *bp, int pool)
+{
+	struct pool_buffer *b = &bp->buffers[pool];
+
+	assert(b->s == s_file);
+	/* Good time to ensure that there will be page-in memory available */
+	if (memory_pool_size(bp, bp->allocated_pool_end - 1) > max_mem)
+		page_out(bp, max_mem - buffer_size);
+	if (!allocate_pool_buffer(bp, pool, true))
+		err(1, "Out of memory paging-in buffer");
+	b->s = s_paging_in;
+	DPRINTF(4, "Page in buffer %d", pool);
+	page_submit(bp, pool, false);
+}
+
+/*
+ * Start reading ahead the temporary file buffers following the
+ * specified one, as long as memory is plentiful.
+ * Memory is otherwise better used for keeping the paged-in data
+ * that lagging sinks will need.
+ */
+static void
+page_read_ahead(struct buffer_pool *bp, int pool)
+{
+	int i;
+
+	for (i = pool; i < pool + PAGE_READ_AHEAD && i < bp->allocated_pool_end; i++)
+		if (bp->buffers[i].s == s_file) {
+			if (memory_pool_size(bp, bp->allocated_pool_end - 1) + buffer_size > max_mem / 2 ||
+			    !graph_available(1))
+				break;
+			page_in_start(bp, i);
+		}
+}
+
+/*
+ * Ensure that the specified pool buffer is in memory
+ */
+static void
+page_in(struct buffer_pool *bp, int pool)
+{
+	struct pool_buffer *b = &bp->buffers[pool];
+
+	switch (b->s) {
+	case s_memory_backed:
+	case s_memory:
+	case s_paging_out:
+	case s_mapped:
+		break;
+	case s_file:
+		page_in_start(bp, pool);
+		/* FALLTHROUGH */
+	case s_paging_in:
+		page_wait(bp, pool);
+		break;
+	case s_none:
+	default:
+		DPRINTF(4, "Buffer %d has invalid storage %d", pool, b->s);
+		assert(false);
+		break;
+	}
+
+}
+
+/*
+ * Ensure that the pool_buffers vector can hold the specified pool.
+ * Return false if no memory is available for it.
+ */
+static bool
+pool_resize(struct buffer_pool *bp, int pool)
+{
+	int orig_pool_size;
+	struct pool_buffer *orig_buffers;
+
+	/* Keep original values to undo on failure. */
+	orig_pool_size = bp->pool_size;
+	orig_buffers = bp->buffers;
+	/* Resize bank, if needed. One iteration should suffice. */
+	while (pool >= bp->pool_size) {
+		if (bp->pool_size == 0)
+			bp->pool_size = 1;
+		else
+			bp->pool_size *= 2;
+		if ((bp->buffers = realloc(bp->buffers, bp->pool_size * sizeof(struct pool_buffer))) == NULL) {
+			DPRINTF(4, "Unable to reallocate buffer pool bank");
+			bp->pool_size = orig_pool_size;
+			bp->buffers = orig_buffers;
+			return false;
+		}
+	}
 	return true;
 }
 
 /*
- * Return a buffer to read from for writing to a file from a position onward
- * When processing lines, b.size can be 0
+ * Allocate memory for the specified pool
+ * If we're out of memory by reaching the user-specified limit
+ * or a system's hard limit return false.
+ * If sufficient memory is available return true.
+ * buffers[pool] will then point to a buffer_size block of available memory.
+ */
+static bool
+memory_allocate(struct buffer_pool *bp, int pool)
+{
+	int i;
+
+	if (pool < bp->allocated_pool_end)
+		return true;
+
+	DPRINTF(4, "Buffers allocated: %d Freed: %d", bp->buffers_allocated, bp->buffers_freed);
+	/*
+	 * Start paging out in the background before the memory
+	 * limit is reached, so that reading need not wait for it.
+	 */
+	if (use_tmp_file && memory_pool_size(bp, pool) > max_mem / 4 * 3)
+		page_out(bp, max_mem / 2);
+	/* Check soft memory limit through allocated plus requested memory. */
+	if (memory_pool_size(bp, pool) > max_mem) {
+		if (use_tmp_file) {
+			page_out(bp, max_mem / 2);
+			while (memory_pool_size(bp, pool) > max_mem &&
+			    bp->buffers_paging_out > 0 && page_wait_any())
+				;
+		} else
+			return false;
+	}
+	/* Likewise when the graph's memory budget is exhausted */
+	if (use_tmp_file && !graph_available(pool - bp->allocated_pool_end + 1)) {
+		page_out(bp, memory_pool_size(bp, bp->allocated_pool_end - 1) / 2);
+		while (!graph_available(pool - bp->allocated_pool_end + 1) &&
+		    bp->buffers_paging_out > 0 && page_wait_any())
+			;
+	}
+
+	if (!pool_resize(bp, pool))
+		return false;
+
+	/* Allocate buffer memory [allocated_pool_end, pool]. */
+	for (i = bp->allocated_pool_end; i <= pool; i++)
+		if (!allocate_pool_buffer(bp, i, bp->buffers_allocated -
+		    bp->buffers_freed < GRAPH_MIN_BUFFERS)) {
+			bp->allocated_pool_end = i;
+			return false;
+		}
+	bp->allocated_pool_end = pool + 1;
+	return true;
+}
+
+/*
+ * Free a file-backed buffer at the specified pool location
+ * by punching a hole to the file. This is a best effort
+ * operation, as it is only supported on Linux.
+ */
+static void
+buffer_file_free(struct buffer_pool *bp, int pool)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+	static bool warned = false;
+	struct pool_buffer *b = &bp->buffers[pool];
+	off_t length = b->file_length;
+
+	/* Include the padding of compressed extents */
+	if (opt_compress)
+		length = (length + PAGE_FILE_BLOCK - 1) / PAGE_FILE_BLOCK * PAGE_FILE_BLOCK;
+	if (fallocate(bp->page_file_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	    b->file_offset, length) < 0 &&
+	    !warned) {
+		warn("Failed to free temporary buffer space");
+		warned = true;
+	}
+#endif
+	bp->pages_freed++;
+}
+
+/*
+ * Release the pages of a freed mapped buffer from the process's
+ * resident memory; they remain in the page cache.
+ * Only pages lying wholly within the buffer are released,
+ * because the following buffer can share its first page.
+ * Freed buffers are always complete, so they lie within the mapping.
+ */
+static void
+buffer_unmap(void *p)
+{
+#ifdef MADV_DONTNEED
+	static uintptr_t page_size;
+	uintptr_t begin, end;
+
+	if (page_size == 0)
+		page_size = sysconf(_SC_PAGESIZE);
+	begin = ((uintptr_t)p + page_size - 1) / page_size * page_size;
+	end = ((uintptr_t)p + buffer_size) / page_size * page_size;
+	if (begin < end)
+		(void)madvise((void *)begin, end - begin, MADV_DONTNEED);
+#endif
+}
+
+/*
+ * Ensure that pool buffers from [0,pos) are free.
+ */
+static void
+memory_free(struct buffer_pool *bp, off_t pos)
+{
+	int pool_end = pos / buffer_size;
+	int i;
+
+	DPRINTF(4, "memory_free: pool=%p pos = %ld, begin=%d end=%d",
+		bp, (long)pos, bp->free_pool_begin, pool_end);
+	for (i = bp->free_pool_begin; i < pool_end; i++) {
+		page_wait(bp, i);
+		switch (bp->buffers[i].s) {
+		case s_memory:
+			buffer_put(bp->buffers[i].p);
+			bp->buffers_freed++;
+			break;
+		case s_file:
+			buffer_file_free(bp, i);
+			break;
+		case s_memory_backed:
+			buffer_file_free(bp, i);
+			buffer_put(bp->buffers[i].p);
+			bp->buffers_freed++;
+			break;
+		case s_mapped:
+			buffer_unmap(bp->buffers[i].p);
+			break;
+		case s_none:
+			break;
+		case s_paging_out:
+		case s_paging_in:
+		default:
+			assert(false);
+			break;
+		}
+		bp->buffers[i].s = s_none;
+		DPRINTF(4, "Freed buffer %d %p (pos = %ld, begin=%d end=%d)",
+			i, bp->buffers[i].p, (long)pos, bp->free_pool_begin, pool_end);
+		#ifdef DEBUG
+		bp->buffers[i].p = NULL;
+		#endif
+	}
+	bp->free_pool_begin = pool_end;
+}
+
+/*
+ * Set the buffer to write to for reading from a file from
+ * position onward, ensuring that sufficient memory is allocated.
+ * Return false if no memory is available.
+ */
+static bool
+source_buffer(struct source_info *ifp, /* OUT */ struct io_buffer *b)
+{
+	int pool = ifp->source_pos_read / buffer_size;
+	size_t pool_offset = ifp->source_pos_read % buffer_size;
+
+	if (!memory_allocate(ifp->bp, pool))
+		return false;
+	if (ifp->bp->buffers[pool].s != s_memory)
+		DPRINTF(4, "ifp->bp->buffers[pool].s = 0x%x, pool=%d\n", ifp->bp->buffers[pool].s, pool);
+	assert(ifp->bp->buffers[pool].s == s_memory);
+	b->p = ifp->bp->buffers[pool].p + pool_offset;
+	b->size = buffer_size - pool_offset;
+	DPRINTF(4, "Source buffer(%ld) returns pool %d(%p) o=%ld l=%ld a=%p",
+		(long)ifp->source_pos_read, pool, ifp->bp->buffers[pool].p, (long)pool_offset, (long)b->size, b->p);
+	return true;
+}
+
+/*
+ * Fill the specified I/O vector with the pool buffer regions to read
+ * into from the source's read position onward, and return the number
+ * of elements filled, or 0 if no memory is available.
+ * This is normally the rest of the current pool buffer.
+ * With adaptive reads (-P), regions of the following buffers are
+ * added so that reads can be as large as twice the average of
+ * recent ones, rather than being cut short by the buffer's end.
+ * As buffers other than the last may be paged out while they are
+ * being read into, this is not done with a temporary file.
+ */
+static int
+source_iovec(struct source_info *ifp, struct iovec *iov)
+{
+	struct io_buffer b;
+	size_t len, want;
+	int n, pool;
+
+	if (!source_buffer(ifp, &b))
+		return 0;
+	iov[0].iov_base = b.p;
+	iov[0].iov_len = len = b.size;
+	if (opt_pipe_size == 0 || use_tmp_file)
+		return 1;
+	want = MIN(MAX(2 * ifp->read_avg, READ_SIZE_MIN), opt_pipe_size);
+	pool = ifp->source_pos_read / buffer_size;
+	for (n = 1; len < want && n < IOV_MAX; n++) {
+		if (!memory_allocate(ifp->bp, ++pool))
+			break;
+		iov[n].iov_base = ifp->bp->buffers[pool].p;
+		iov[n].iov_len = MIN(buffer_size, want - len);
+		len += iov[n].iov_len;
+	}
+	return n;
+}
+
+/* Account for the specified number of bytes read from a source */
+static void
+source_read_done(struct source_info *ifp, ssize_t n)
+{
+	ifp->reads++;
+	if (n <= 0)
+		return;
+	ifp->source_pos_read += n;
+	ifp->read_avg = ifp->read_avg * (1 - READ_SIZE_WEIGHT) +
+		n * READ_SIZE_WEIGHT;
+}
+
+/*
+ * Serve the data of a regular file source from a read-only mapping
+ * of the file, rather than reading them into pool buffers.
+ * The pool buffers then point into the mapping; they do not count
+ * against the memory limit and are never paged out.
+ * The data are those up to the file's size at this point.
+ * Sources that cannot be mapped are read as usual.
+ */
+static void
+source_map(struct source_info *ifp)
+{
+	struct stat sb;
+	off_t start;
+	char *p;
+
+	if (fstat(ifp->fd, &sb) < 0)
+		err(2, "Error getting status of %s", fp_name(ifp));
+	if (!S_ISREG(sb.st_mode) ||
+	    (unsigned long long)sb.st_size > SIZE_MAX ||
+	    (start = lseek(ifp->fd, 0, SEEK_CUR)) < 0 ||
+	    start >= sb.st_size)
+		return;
+	if ((p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, ifp->fd, 0)) == MAP_FAILED) {
+		DPRINTF(2, "Unable to map %s", fp_name(ifp));
+		return;
+	}
+#ifdef MADV_SEQUENTIAL
+	(void)madvise(p, sb.st_size, MADV_SEQUENTIAL);
+#endif
+	ifp->map = p + start;
+	ifp->map_size = sb.st_size - start;
+	ifp->map_offset = start;
+	DPRINTF(3, "Mapped %zu bytes of %s", ifp->map_size, fp_name(ifp));
+}
+
+/*
+ * Advance the file offset of a mapped source past the data taken from
+ * the mapping, as reading them would, so that the processes sharing
+ * the file descriptor, such as a shell's next command, continue after them.
+ */
+static void
+source_map_seek(struct source_info *ifp)
+{
+	(void)lseek(ifp->fd, ifp->map_offset + ifp->source_pos_read, SEEK_SET);
+}
+
+/*
+ * Make the next buffer of a mapped source's data available to its
+ * sinks, as reading would, by pointing its pool buffer into the mapping.
+ * Return the number of bytes made available, or 0 at the end of the data.
+ */
+static size_t
+source_map_read(struct source_info *ifp)
+{
+	struct buffer_pool *bp = ifp->bp;
+	int pool = ifp->source_pos_read / buffer_size;
+	size_t n;
+
+	if ((size_t)ifp->source_pos_read == ifp->map_size)
+		return 0;
+	if (!pool_resize(bp, pool))
+		err(1, "Unable to extend the buffer pool of %s", fp_name(ifp));
+	bp->buffers[pool].p = ifp->map + (size_t)pool * buffer_size;
+	bp->buffers[pool].s = s_mapped;
+	bp->buffers_mapped++;
+	bp->allocated_pool_end = pool + 1;
+	n = MIN(buffer_size - ifp->source_pos_read % buffer_size,
+		ifp->map_size - ifp->source_pos_read);
+	ifp->source_pos_read += n;
+	source_map_seek(ifp);
+	DPRINTF(4, "Mapped buffer %d of %s", pool, fp_name(ifp));
+	return n;
+}
+
+/*
+ * Account for the specified number of bytes written to a sink
+ * from the I/O vector filled by sink_iovec.
+ */
+static void
+sink_written(struct sink_info *ofp, size_t n)
+{
+	size_t held_n = MIN(n, ofp->held_len - ofp->held_written);
+	size_t tag_n = MIN(n - held_n, ofp->tag_len - ofp->tag_written);
+
+	ofp->held_written += held_n;
+	ofp->tag_written += tag_n;
+	ofp->pos_written += n - held_n - tag_n;
+	ofp->bytes_written += n;
+}
+
+/* Return true if the sink has data allocated to it that it has not written */
+static bool
+sink_pending(struct sink_info *ofp)
+{
+	return ofp->pos_written < ofp->pos_to_write ||
+		ofp->held_written < ofp->held_len;
+}
+
+/*
+ * Fill the specified I/O vector with the pool buffer regions to write
+ * to a sink from its written position onward, gathering up to IOV_MAX
+ * buffers until the position up to which to write.
+ * Gathering stops at buffers that are not in memory; reading them
+ * and the ones following them from the temporary file is started
+ * in the background, as long as memory is available.
+ * Return the number of vector elements filled.
+ * When processing lines or paging in, this can be 0.
+ */
+static int
+sink_iovec(struct sink_info *ofp, struct iovec *iov)
+{
+	struct buffer_pool *bp = ofp->ifp->bp;
+	off_t pos = ofp->pos_written;
+	int n = 0;
+
+	/* A lossy sink's held data precede the pool data. */
+	if (ofp->held_written < ofp->held_len) {
+		iov[n].iov_base = ofp->held + ofp->held_written;
+		iov[n].iov_len = ofp->held_len - ofp->held_written;
+		n++;
+	}
+	/* A sequence tag precedes the chunk's data. */
+	if (ofp->tag_written < ofp->tag_len) {
+		iov[n].iov_base = ofp->tag + ofp->tag_written;
+		iov[n].iov_len = ofp->tag_len - ofp->tag_written;
+		n++;
+	}
+	for (; n < IOV_MAX && pos < ofp->pos_to_write; n++) {
+		int pool = pos / buffer_size;
+		size_t pool_offset = pos % buffer_size;
+
+		if (bp->buffers[pool].s == s_file ||
+		    bp->buffers[pool].s == s_paging_in) {
+			/* The sink must always be able to make progress. */
+			if (pos == ofp->pos_written && bp->buffers[pool].s == s_file)
+				page_in_start(bp, pool);
+			page_read_ahead(bp, pool);
+			break;
+		}
+		iov[n].iov_base = (char *)bp->buffers[pool].p + pool_offset;
+		iov[n].iov_len = MIN(buffer_size - pool_offset, ofp->pos_to_write - pos);
+		pos += iov[n].iov_len;
+	}
+	DPRINTF(4, "Sink iovec(%ld-%ld) returns %d buffers up to %ld for input fd: %s",
+		(long)ofp->pos_written, (long)ofp->pos_to_write, n, (long)pos, fp_name(ofp->ifp));
+	return n;
+}
+
+/*
+ * Have the sink copy data of mapped sources within the kernel,
+ * if it is a regular file that is not opened for appending.
+ */
+static void
+sink_copy_setup(struct sink_info *ofp)
+{
+#ifdef __linux__
+	struct stat sb;
+	int flags;
+
+	if (fstat(ofp->fd, &sb) < 0)
+		err(2, "Error getting status of %s", fp_name(ofp));
+	if (S_ISREG(sb.st_mode) && (flags = fcntl(ofp->fd, F_GETFL)) >= 0 &&
+	    !(flags & O_APPEND))
+		ofp->file_copy = fc_copy_range;
+#endif
+}
+
+/*
+ * Return the mapped source from which the data that the sink's
+ * I/O vector refers to can be copied within the kernel,
+ * or NULL if they must be written from memory.
+ */
+static struct source_info *
+sink_copy_source(struct sink_info *ofp)
+{
+	if (ofp->file_copy == fc_none || ofp->ifp->map == NULL ||
+	    ofp->held_written < ofp->held_len || ofp->tag_written < ofp->tag_len)
+		return NULL;
+	return ofp->ifp;
+}
+
+/*
+ * Write to a sink the data of the I/O vector filled by sink_iovec.
+ * If ifp is not NULL, the data, which start at the specified position
+ * of the mapped source ifp, are copied from its file within the kernel.
+ * When the files involved do not support a copying method, the next
+ * one is tried, down to writing the data from memory.
+ * Return the number of bytes written, or -1 on error.
+ */
+static ssize_t
+sink_transfer(struct sink_info *ofp, struct source_info *ifp, off_t pos,
+    const struct iovec *iov, int iovcnt)
+{
+#ifdef __linux__
+	off_t offset;
+	size_t len = 0;
+	ssize_t n;
+	int i;
+
+	if (ifp == NULL)
+		return writev(ofp->fd, iov, iovcnt);
+	offset = ifp->map_offset + pos;
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	for (;;) {
+		switch (ofp->file_copy) {
+		case fc_copy_range:
+			n = copy_file_range(ifp->fd, &offset, ofp->fd, NULL, len, 0);
+			break;
+		case fc_sendfile:
+			n = sendfile(ofp->fd, ifp->fd, &offset, len);
+			break;
+		case fc_none:
+		default:
+			return writev(ofp->fd, iov, iovcnt);
+		}
+		if (n >= 0 || (errno != EXDEV && errno != EINVAL &&
+		    errno != ENOSYS && errno != EOPNOTSUPP))
+			return n;
+		DPRINTF(2, "Unable to copy %s to %s within the kernel",
+			fp_name(ifp), fp_name(ofp));
+		ofp->file_copy = ofp->file_copy == fc_copy_range ? fc_sendfile : fc_none;
+	}
+#else
+	return writev(ofp->fd, iov, iovcnt);
+#endif
+}
+
+/*
+ * Return a pointer to read from for writing to a file from a position onward
+ */
+static char *
+sink_pointer(struct buffer_pool *bp, off_t pos_written)
+{
+	int pool = pos_written / buffer_size;
+	size_t pool_offset = pos_written % buffer_size;
+
+	if (bp->page_file_fd != -1)
+		page_in(bp, pool);
+	return bp->buffers[pool].p + pool_offset;
+}
+
+#ifdef __APPLE__
+/* Locate the last occurrence of c in the n bytes of s, like GNU memrchr(3) */
+static void *
+memrchr(const void *s, int c, size_t n)
+{
+	const unsigned char *p = (const unsigned char *)s + n;
+
+	while (p > (const unsigned char *)s)
+		if (*--p == (unsigned char)c)
+			return (void *)p;
+	return NULL;
+}
+#endif
+
+/*
+ * Return the size of a buffer region that can be read for the specified endpoints
+ */
+static size_t
+sink_buffer_length(off_t start, off_t end)
+{
+	size_t pool_offset = start % buffer_size;
+	size_t source_bytes = end - start;
+
+	DPRINTF(4, "sink_buffer_length(%ld, %ld) = %ld",
+		(long)start, (long)end,  (long)MIN(buffer_size - pool_offset, source_bytes));
+	return MIN(buffer_size - pool_offset, source_bytes);
+}
+
+/*
+ * Return the position of the first record terminator in the pool
+ * region [start, end), or -1 if there is none.
+ * The region is searched with memchr(3) over contiguous pool buffer spans,
+ * so that records straddling buffers are also handled.
+ */
+static off_t
+record_find_forward(struct buffer_pool *bp, off_t start, off_t end)
+{
+	while (start < end) {
+		size_t len = sink_buffer_length(start, end);
+		char *p = sink_pointer(bp, start);
+		char *found = memchr(p, rt, len);
+
+		if (found)
+			return start + (found - p);
+		start += len;
+	}
+	return -1;
+}
+
+/*
+ * Return the position of the last record terminator in the pool
+ * region [start, end), or -1 if there is none.
+ */
+static off_t
+record_find_backward(struct buffer_pool *bp, off_t start, off_t end)
+{
+	while (end > start) {
+		off_t span_start = MAX(start, (end - 1) / buffer_size * buffer_size);
+		char *p = sink_pointer(bp, span_start);
+		char *found = memrchr(p, rt, end - span_start);
+
+		if (found)
+			return span_start + (found - p);
+		end = span_start;
+	}
+	return -1;
+}
+
+/* The result of the following read operation. */
+enum read_result {
+	read_ok,	/* Normal read */
+	read_oom,	/* Out of buffer memory */
+	read_again,	/* EAGAIN */
+	read_eof,	/* EOF (0 bytes read) */
+};
+
+/*
+ * Read from the source into the memory buffer
+ * Return the number of bytes read, or -1 on end of file.
+ */
+static enum read_result
+source_read(struct source_info *ifp)
+{
+	ssize_t n;
+	struct iovec iov[IOV_MAX];
+	int iovcnt;
+
+	if (ifp->map != NULL)
+		return source_map_read(ifp) ? read_ok : read_eof;
+	if ((iovcnt = source_iovec(ifp, iov)) == 0) {
+		DPRINTF(4, "Memory full");
+		/* Provide some time for the output to drain. */
+		return read_oom;
+	}
+	n = readv(ifp->fd, iov, iovcnt);
+	source_read_done(ifp, n);
+	if (n == -1)
+		switch (errno) {
+		case EAGAIN:
+			DPRINTF(4, "EAGAIN on %s", fp_name(ifp));
+			ifp->ready = false;
+			return read_again;
+		default:
+			err(3, "Read from %s", fp_name(ifp));
+		}
+	DPRINTF(4, "Read %ld bytes into %d buffers from %s data=[%.*s]", (long)n, iovcnt, fp_name(ifp),
+		(int)MIN(n, iov[0].iov_len) * DATA_DUMP, (char *)iov[0].iov_base);
+	/* Return -1 on EOF */
+	return n ? read_ok : read_eof;
+}
+
+#ifdef SPLICE_F_NONBLOCK
+/* Return true if data can be written to fd without blocking. */
+static bool
+fd_writable(int fd)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT);
+}
+
+/*
+ * Handle the result of a tee(2) or splice(2) call to the specified sink.
+ * Return the number of bytes transferred, 0 if the sink is blocked,
+ * or -1 if the sink's reader has terminated.
+ */
+static ssize_t
+sink_splice_result(struct sink_info *ofp, ssize_t n)
+{
+	if (n > 0)
+		sink_blocked(ofp, false);
+	if (n >= 0) {
+		ofp->bytes_written += n;
+		return n;
+	}
+	switch (errno) {
+	/* EPIPE is acceptable, for the sink's reader can terminate early. */
+	case EPIPE:
+		ofp->active = false;
+		(void)close(ofp->fd);
+		DPRINTF(4, "EPIPE for %s", fp_name(ofp));
+		return -1;
+	case EAGAIN:
+		DPRINTF(4, "EAGAIN for %s", fp_name(ofp));
+		/*
+		 * The error can also come from an empty source; wait for
+		 * the sink's readiness only if it is actually full.
+		 */
+		if (!fd_writable(ofp->fd))
+			ofp->ready = false;
+		sink_blocked(ofp, true);
+		return 0;
+	default:
+		err(2, "Error splicing to %s", fp_name(ofp));
+	}
+}
+
+/*
+ * Transfer data from a pipe source directly to the pipe sinks
+ * reading it, without copying it through user space.
+ * The source's pipe pages are duplicated into all sinks but the last
+ * one with tee(2), and are then moved into the last sink with splice(2).
+ * This is only attempted when all sinks have written all data read
+ * so far from the source.
+ * Data that some blocked sinks could not receive is read into the
+ * buffer pool, from where it is written out through sink_write.
+ * Return false if no data could be transferred in this way.
+ */
+static bool
+source_splice(struct source_info *ifp, struct sink_info *ofiles,
+		/* OUT */ enum read_result *result)
+{
+	struct sink_info *ofp, *last = NULL;
+	struct io_buffer b;
+	off_t pos = ifp->source_pos_read;
+	ssize_t n, min_n, max_n = 0;
+	bool eof = false;
+
+	for (ofp = ofiles; ofp; ofp = ofp->next) {
+		if (!ofp->active || ofp->ifp != ifp)
+			continue;
+		if (!ofp->is_pipe || ofp->pos_written != pos)
+			return false;
+		last = ofp;
+	}
+	if (last == NULL)
+		return false;
+
+	/*
+	 * Limit the transfer to the free space of the current pool buffer,
+	 * where the data blocked sinks fail to receive will be stored.
+	 */
+	if (!source_buffer(ifp, &b))
+		return false;
+	min_n = b.size;
+
+	for (ofp = ofiles; ofp != last; ofp = ofp->next) {
+		if (!ofp->active || ofp->ifp != ifp)
+			continue;
+		/* A zero return signifies the end of the input. */
+		ofp->writes++;
+		if ((n = tee(ifp->fd, ofp->fd, b.size, SPLICE_F_NONBLOCK)) == 0) {
+			eof = true;
+			break;
+		}
+		if ((n = sink_splice_result(ofp, n)) == -1)
+			continue;
+		ofp->pos_written = pos + n;
+		min_n = MIN(min_n, n);
+		max_n = MAX(max_n, n);
+	}
+	if (eof) {
+		*result = read_eof;
+		return true;
+	}
+
+	/* Move to the last sink the data all others have also received. */
+	if (min_n > 0) {
+		last->writes++;
+		if ((n = splice(ifp->fd, NULL, last->fd, NULL, min_n,
+		    SPLICE_F_NONBLOCK)) == 0) {
+			*result = read_eof;
+			return true;
+		}
+		if ((n = sink_splice_result(last, n)) == -1)
+			n = 0;
+		else
+			last->pos_written = pos + n;
+	} else
+		n = 0;
+	max_n = MAX(max_n, n);
+	if (max_n == 0)
+		return false;
+
+	/* Buffer the data teed to some sinks, but not consumed by splice. */
+	ifp->source_pos_read = pos + n;
+	while (ifp->source_pos_read < pos + max_n) {
+		ssize_t nread = read(ifp->fd, (char *)b.p + (ifp->source_pos_read - pos),
+				pos + max_n - ifp->source_pos_read);
+
+		ifp->reads++;
+
+		if (nread <= 0)
+			err(3, "Read of teed data from %s", fp_name(ifp));
+		ifp->source_pos_read += nread;
+	}
+	DPRINTF(4, "Spliced %ld bytes, buffered %ld bytes from %s",
+		(long)n, (long)(max_n - n), fp_name(ifp));
+	*result = read_ok;
+	return true;
+}
+#endif
+
+/*
+ * Transfer data from the source to its sinks, with zero-copy
+ * if possible, or by reading it into the memory buffer.
+ */
+static enum read_result
+source_transfer(struct source_info *ifp, struct sink_info *ofiles)
+{
+#ifdef SPLICE_F_NONBLOCK
+	enum read_result result;
+
+	if (opt_zero_copy && ifp->is_pipe && !opt_scatter &&
+	    source_splice(ifp, ofiles, &result))
+		return result;
+#endif
+	return source_read(ifp);
+}
+
+/* Return true if the specified file descriptor is a pipe. */
+static bool
+is_pipe(int fd)
+{
+	struct stat sb;
+
+	if (fstat(fd, &sb) < 0)
+		err(2, "Error getting status of fd %d", fd);
+	return S_ISFIFO(sb.st_mode);
+}
+
+/*
+ * Raise the capacity of the specified pipe to the size specified
+ * with -P, within the system's limit.
+ * Return the pipe's capacity, or 0 if fd is not a pipe or its
+ * capacity cannot be determined.
+ */
+static int
+pipe_size_set(int fd)
+{
+#ifdef F_SETPIPE_SZ
+	static unsigned long max_size;
+	unsigned long size;
+	FILE *f;
+
+	if (!is_pipe(fd))
+		return 0;
+	if (max_size == 0) {
+		if ((f = fopen("/proc/sys/fs/pipe-max-size", "r")) == NULL ||
+		    fscanf(f, "%lu", &max_size) != 1)
+			max_size = opt_pipe_size;
+		if (f)
+			fclose(f);
+	}
+	size = MIN(opt_pipe_size, max_size);
+	/* Failures, such as exceeding the user's pipe quota, leave it as is. */
+	if (fcntl(fd, F_GETPIPE_SZ) < (int)size &&
+	    fcntl(fd, F_SETPIPE_SZ, (int)size) < 0)
+		DPRINTF(2, "Unable to set the size of pipe %d to %lu", fd, size);
+	return MAX(fcntl(fd, F_GETPIPE_SZ), 0);
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Return the number of bytes written to the sink that its reader
+ * has not yet consumed, or 0 if this cannot be determined.
+ */
+static off_t
+sink_outstanding(struct sink_info *ofp)
+{
+	int n;
+
+	if (ioctl(ofp->fd, FIONREAD, &n) < 0)
+		return 0;
+	return n;
+}
+
+/*
+ * Update the moving average of the rate at which the reader of
+ * the specified sink consumes data.
+ * A sample is only taken if the sink had data waiting to be consumed
+ * at the previous sample; otherwise its reader may have been idle.
+ */
+static void
+drain_rate_update(struct sink_info *ofp, double now)
+{
+	off_t outstanding, consumed;
+	double rate, dt = now - ofp->drain_time;
+
+	if (dt < DRAIN_SAMPLE_INTERVAL)
+		return;
+	outstanding = sink_outstanding(ofp);
+	consumed = ofp->bytes_written - outstanding;
+	if (ofp->drain_backlog > 0) {
+		rate = (consumed - ofp->drain_consumed) / dt;
+		/*
+		 * If the whole backlog was consumed the reader may have
+		 * idled; the sample is then only a lower bound.
+		 */
+		if (consumed - ofp->drain_consumed >= ofp->drain_backlog)
+			rate = MAX(rate, ofp->drain_rate);
+		if (ofp->drain_rate == 0)
+			ofp->drain_rate = rate;
+		else
+			ofp->drain_rate = DRAIN_RATE_WEIGHT * rate +
+				(1 - DRAIN_RATE_WEIGHT) * ofp->drain_rate;
+		DPRINTF(4, "%s(): %s drain rate %g", __func__, fp_name(ofp),
+				ofp->drain_rate);
+	}
+	ofp->drain_time = now;
+	ofp->drain_consumed = consumed;
+	ofp->drain_backlog = outstanding + (ofp->pos_to_write - ofp->pos_written);
+}
+
+/* Order doubles in ascending order; qsort(3) helper */
+static int
+double_compare(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+/* Return true if the sink can be given a new part of the scattered data */
+static inline bool
+scatter_available(struct sink_info *ofp)
+{
+	return ofp->pos_written == ofp->pos_to_write && fp_ready(ofp);
+}
+
+/*
+ * Divide the specified units of data (bytes or blocks of unit_size)
+ * among the sinks available for scattering, according to the
+ * scatter policy, by setting their scatter_share.
+ * The rounding remainder goes to the (first) sink with the largest part.
+ */
+static void
+scatter_shares(struct sink_info *files, size_t units, size_t unit_size)
+{
+	static double *levels;
+	static int nlevels;
+	struct sink_info *ofp, *largest = NULL;
+	double total_weight = 0, level, sum;
+	size_t assigned = 0;
+	int i, n = 0;
+
+	switch (scatter_policy) {
+	case sp_equal:
+	case sp_split:	/* Only when the input cannot be split */
+	case sp_hash:	/* Records are routed, rather than divided */
+	case sp_range:
+		for (ofp = files; ofp; ofp = ofp->next)
+			ofp->scatter_weight = 1;
+		break;
+	case sp_outstanding:
+		/*
+		 * Fill the sinks up to a common level of unconsumed data,
+		 * starting from the one with the least.
+		 */
+		for (ofp = files; ofp; ofp = ofp->next) {
+			if (!scatter_available(ofp))
+				continue;
+			if (n == nlevels) {
+				nlevels = nlevels ? nlevels * 2 : 16;
+				if ((levels = realloc(levels,
+				    nlevels * sizeof(*levels))) == NULL)
+					err(1, NULL);
+			}
+			ofp->scatter_weight = (double)sink_outstanding(ofp) / unit_size;
+			levels[n++] = ofp->scatter_weight;
+		}
+		qsort(levels, n, sizeof(*levels), double_compare);
+		sum = levels[0];
+		for (i = 1; i < n; i++) {
+			if ((units + sum) / i <= levels[i])
+				break;
+			sum += levels[i];
+		}
+		level = (units + sum) / i;
+		for (ofp = files; ofp; ofp = ofp->next)
+			ofp->scatter_weight = MAX(level - ofp->scatter_weight, 0);
+		break;
+	case sp_rate:
+		/* Sinks with no known rate are assumed to drain at the average one */
+		for (ofp = files; ofp; ofp = ofp->next)
+			if (scatter_available(ofp) && ofp->drain_rate > 0) {
+				total_weight += ofp->drain_rate;
+				n++;
+			}
+		level = n ? total_weight / n : 1;
+		for (ofp = files; ofp; ofp = ofp->next)
+			ofp->scatter_weight = ofp->drain_rate > 0 ?
+				ofp->drain_rate : level;
+		total_weight = 0;
+		break;
+	}
+
+	for (ofp = files; ofp; ofp = ofp->next)
+		if (scatter_available(ofp))
+			total_weight += ofp->scatter_weight;
+	for (ofp = files; ofp; ofp = ofp->next) {
+		if (!scatter_available(ofp))
+			continue;
+		ofp->scatter_share = total_weight > 0 ?
+			units * ofp->scatter_weight / total_weight : 0;
+		/* Guard against floating point rounding overshooting units */
+		ofp->scatter_share = MIN(ofp->scatter_share, units - assigned);
+		assigned += ofp->scatter_share;
+		if (largest == NULL ||
+		    ofp->scatter_weight > largest->scatter_weight)
+			largest = ofp;
+	}
+	if (largest)
+		largest->scatter_share += units - assigned;
+}
+
+/*
+ * Return a pointer to the start of the specified (0-based) field
+ * of the record [p, e), or e if the record has fewer fields.
+ * Fields are separated by blanks, which are skipped, as with sort(1) -b.
+ */
+static const char *
+field_start(const char *p, const char *e, int field)
+{
+	for (;;) {
+		while (p < e && isblank((unsigned char)*p))
+			p++;
+		if (field-- == 0 || p == e)
+			return p;
+		while (p < e && !isblank((unsigned char)*p))
+			p++;
+	}
+}
+
+/*
+ * Return a pointer to the end of the specified key
+ * in the record [p, e), which starts at its first field.
+ */
+static const char *
+key_end(const char *p, const char *e, const struct sort_key *k)
+{
+	if (k->field_end == -1)
+		return e;
+	p = field_start(p, e, k->field_end);
+	while (p < e && !isblank((unsigned char)*p))
+		p++;
+	return p;
+}
+
+/* Order byte sequences lexicographically, with shorter prefixes first */
+static int
+bytes_compare(const char *a, size_t alen, const char *b, size_t blen)
+{
+	int r = memcmp(a, b, MIN(alen, blen));
+
+	if (r)
+		return r;
+	return (alen > blen) - (alen < blen);
+}
+
+/*
+ * A numeric key, as sort(1) -n parses it: an optional minus sign,
+ * followed by digits and an optional decimal part.
+ * Leading zeros of the integer part and trailing zeros of the
+ * decimal part are excluded, so that equal numbers have equal digits.
+ */
+struct number {
+	bool negative;
+	const char *int_begin, *int_end;	/* Integer part digits */
+	const char *frac_begin, *frac_end;	/* Decimal part digits */
+};
+
+/* Parse into n the numeric key starting at p and ending by e */
+static void
+number_parse(const char *p, const char *e, struct number *n)
+{
+	n->negative = p < e && *p == '-';
+	if (n->negative)
+		p++;
+	while (p < e && *p == '0')
+		p++;
+	n->int_begin = p;
+	while (p < e && isdigit((unsigned char)*p))
+		p++;
+	n->int_end = n->frac_begin = n->frac_end = p;
+	if (p < e && *p == '.') {
+		n->frac_begin = ++p;
+		while (p < e && isdigit((unsigned char)*p))
+			p++;
+		n->frac_end = p;
+		while (n->frac_end > n->frac_begin && n->frac_end[-1] == '0')
+			n->frac_end--;
+	}
+	/* Zero, including a key without digits, has no sign */
+	if (n->int_begin == n->int_end && n->frac_begin == n->frac_end)
+		n->negative = false;
+}
+
+/* Compare two numeric keys digit by digit, as sort(1) -n does */
+static int
+number_compare(const struct number *a, const struct number *b)
+{
+	size_t alen = a->int_end - a->int_begin;
+	size_t blen = b->int_end - b->int_begin;
+	int r;
+
+	if (a->negative != b->negative)
+		return a->negative ? -1 : 1;
+	if (alen != blen)
+		r = (alen > blen) - (alen < blen);
+	else if ((r = memcmp(a->int_begin, b->int_begin, alen)) == 0)
+		r = bytes_compare(a->frac_begin, a->frac_end - a->frac_begin,
+			b->frac_begin, b->frac_end - b->frac_begin);
+	return a->negative ? -r : r;
+}
+
+/*
+ * Compare the records [a, ae) and [b, be) on the specified keys
+ * or, if none were specified, on their whole content.
+ */
+static int
+record_compare(const char *a, const char *ae, const char *b, const char *be)
+{
+	int i, r;
+
+	for (i = 0; i < nsort_keys; i++) {
+		const struct sort_key *k = &sort_keys[i];
+		const char *ak = field_start(a, ae, k->field_begin);
+		const char *bk = field_start(b, be, k->field_begin);
+
+		if (k->numeric) {
+			struct number an, bn;
+
+			number_parse(ak, ae, &an);
+			number_parse(bk, be, &bn);
+			r = number_compare(&an, &bn);
+		} else {
+			const char *akend = key_end(a, ae, k);
+			const char *bkend = key_end(b, be, k);
+
+			r = bytes_compare(ak, MAX(akend - ak, 0),
+				bk, MAX(bkend - bk, 0));
+		}
+		if (r)
+			return k->reverse ? -r : r;
+	}
+	if (nsort_keys == 0)
+		return bytes_compare(a, ae - a, b, be - b);
+	return 0;
+}
+
+/*
+ * Compare the head records of two inputs.
+ * Records with equal keys are ordered by the inputs' order,
+ * so that the merge is stable.
+ */
+static int
+head_compare(const struct source_info *a, const struct source_info *b)
+{
+	/* Exclude the record terminator */
+	int r = record_compare(a->head, a->head + a->head_len - 1,
+		b->head, b->head + b->head_len - 1);
+
+	return r ? r : a->ordinal - b->ordinal;
+}
+
+/* Restore the heap property of merge_heap from element i downward */
+static void
+merge_heap_down(int i)
+{
+	struct source_info *ifp = merge_heap[i];
+
+	for (;;) {
+		int child = 2 * i + 1;
+
+		if (child >= merge_heap_n)
+			break;
+		if (child + 1 < merge_heap_n &&
+		    head_compare(merge_heap[child + 1], merge_heap[child]) < 0)
+			child++;
+		if (head_compare(ifp, merge_heap[child]) <= 0)
+			break;
+		merge_heap[i] = merge_heap[child];
+		i = child;
+	}
+	merge_heap[i] = ifp;
+}
+
+/* Add an input to merge_heap */
+static void
+merge_heap_push(struct source_info *ifp)
+{
+	int i = merge_heap_n++;
+
+	while (i > 0 && head_compare(ifp, merge_heap[(i - 1) / 2]) < 0) {
+		merge_heap[i] = merge_heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	merge_heap[i] = ifp;
+}
+
+/*
+ * Copy the input's first record that has not been merged to its head,
+ * and free the buffers it occupied.
+ * A terminator is added to an unterminated final record.
+ * Return false if the input has no complete record.
+ */
+static bool
+merge_head_load(struct source_info *ifp)
+{
+	off_t pos, end;
+	size_t len;
+
+	end = record_find_forward(ifp->bp, MAX(ifp->merge_pos, ifp->merge_scanned),
+		ifp->source_pos_read);
+	if (end != -1)
+		end++;
+	else if (ifp->reached_eof && ifp->merge_pos < ifp->source_pos_read)
+		end = ifp->source_pos_read;
+	else {
+		/* Avoid searching the same data again. */
+		ifp->merge_scanned = ifp->source_pos_read;
+		return false;
+	}
+
+	len = end - ifp->merge_pos;
+	if (len + 2 > ifp->head_size) {
+		ifp->head_size = len + 2;
+		if ((ifp->head = (char *)realloc(ifp->head, ifp->head_size)) == NULL)
+			err(1, NULL);
+	}
+	for (pos = ifp->merge_pos; pos < end; ) {
+		size_t n = sink_buffer_length(pos, end);
+
+		memcpy(ifp->head + (pos - ifp->merge_pos), sink_pointer(ifp->bp, pos), n);
+		pos += n;
+	}
+	if (ifp->head[len - 1] != rt)
+		ifp->head[len++] = rt;
+	ifp->head_len = len;
+	ifp->merge_pos = end;
+	memory_free(ifp->bp, ifp->merge_pos);
+	return true;
+}
+
+/* Return true if all the input's records have been merged */
+static bool
+merge_exhausted(struct source_info *ifp)
+{
+	return ifp->reached_eof && ifp->merge_pos == ifp->source_pos_read;
+}
+
+/*
+ * Append the head record of the specified input to the merged source.
+ * Return false if no memory is available for storing all of it;
+ * the rest is appended in a subsequent call.
+ */
+static bool
+merge_emit(struct source_info *ifp)
+{
+	struct io_buffer b;
+
+	while (merge_head_written < ifp->head_len) {
+		size_t n;
+
+		if (!source_buffer(gather_ifp, &b))
+			return false;
+		n = MIN(b.size, ifp->head_len - merge_head_written);
+		memcpy(b.p, ifp->head + merge_head_written, n);
+		merge_head_written += n;
+		gather_ifp->source_pos_read += n;
+	}
+	merge_head_written = 0;
+	return true;
+}
+
+/*
+ * Merge the inputs' records in key order into the merged source,
+ * until the next record of an input or memory for storing the merged
+ * data are not available.
+ * Set the merged source's reached_eof when all records have been merged.
+ */
+static void
+merge_records(void)
+{
+	int i;
+
+	/* Add to the heap the inputs whose next record has become available. */
+	for (i = 0; i < merge_waiting_n; ) {
+		struct source_info *ifp = merge_waiting[i];
+
+		if (merge_head_load(ifp))
+			merge_heap_push(ifp);
+		else if (!merge_exhausted(ifp)) {
+			i++;
+			continue;
+		}
+		ifp->merge_needed = false;
+		merge_waiting[i] = merge_waiting[--merge_waiting_n];
+	}
+	if (merge_waiting_n)
+		return;
+
+	while (merge_heap_n) {
+		struct source_info *ifp = merge_heap[0];
+
+		if (!merge_emit(ifp))
+			return;
+		if (merge_head_load(ifp)) {
+			merge_heap_down(0);
+			continue;
+		}
+		merge_heap[0] = merge_heap[--merge_heap_n];
+		if (merge_heap_n)
+			merge_heap_down(0);
+		if (!merge_exhausted(ifp)) {
+			/* The order of the following records depends on this input. */
+			ifp->merge_needed = true;
+			merge_waiting[merge_waiting_n++] = ifp;
+			return;
+		}
+	}
+	gather_ifp->reached_eof = true;
+	DPRINTF(3, "Merged %ld bytes", (long)gather_ifp->source_pos_read);
+}
+
+/* Return the byte at the specified position of a buffer pool */
+static char
+pool_byte(struct buffer_pool *bp, off_t pos)
+{
+	return *sink_pointer(bp, pos);
+}
+
+/*
+ * Append the input's data from the position up to which they have been
+ * gathered up to the specified end to the destination source, and free
+ * the buffers they occupied.
+ * Return false if no memory is available for storing all of them.
+ */
+static bool
+gather_copy(struct source_info *dest, struct source_info *ifp, off_t end)
+{
+	struct io_buffer b;
+	bool copied = true;
+
+	while (ifp->merge_pos < end) {
+		size_t n;
+
+		if (!source_buffer(dest, &b)) {
+			copied = false;
+			break;
+		}
+		n = MIN(b.size, sink_buffer_length(ifp->merge_pos, end));
+		memcpy(b.p, sink_pointer(ifp->bp, ifp->merge_pos), n);
+		ifp->merge_pos += n;
+		dest->source_pos_read += n;
+	}
+	memory_free(ifp->bp, ifp->merge_pos);
+	return copied;
+}
+
+/*
+ * Read the sequence tag that must follow an input's chunk,
+ * setting the input's chunk_seq to its value.
+ * Leave chunk_seq at -1 if the tag is not yet completely available.
+ */
+static void
+seq_tag_read(struct source_info *ifp)
+{
+	char tag[SEQ_TAG_SIZE];
+	off_t end;
+
+	if (ifp->merge_pos == ifp->source_pos_read)
+		return;
+	if (pool_byte(ifp->bp, ifp->merge_pos) != SEQ_TAG)
+		errx(1, "Data without a sequence tag in %s at position %ld",
+			fp_name(ifp), (long)ifp->merge_pos);
+	end = record_find_forward(ifp->bp, ifp->merge_pos, ifp->source_pos_read);
+	if (end == -1) {
+		if (ifp->reached_eof || ifp->source_pos_read - ifp->merge_pos >= SEQ_TAG_SIZE)
+			errx(1, "Invalid sequence tag in %s", fp_name(ifp));
+		return;
+	}
+	if (end - ifp->merge_pos >= SEQ_TAG_SIZE)
+		errx(1, "Invalid sequence tag in %s", fp_name(ifp));
+	memcpy(tag, sink_pointer(ifp->bp, ifp->merge_pos), end - ifp->merge_pos);
+	/* A tag can straddle two buffers. */
+	if (sink_buffer_length(ifp->merge_pos, end) < (size_t)(end - ifp->merge_pos)) {
+		size_t n = sink_buffer_length(ifp->merge_pos, end);
+
+		memcpy(tag + n, sink_pointer(ifp->bp, ifp->merge_pos + n),
+			end - ifp->merge_pos - n);
+	}
+	tag[end - ifp->merge_pos] = '\0';
+	ifp->chunk_seq = strtoll(tag + 1, NULL, 10);
+	ifp->merge_pos = ifp->seq_data_end = end + 1;
+	memory_free(ifp->bp, ifp->merge_pos);
+}
+
+/*
+ * Advance the input's seq_data_end over the complete records of its
+ * current chunk.
+ * Return true if the chunk's end, marked by the next chunk's tag or by
+ * the input's end, has been reached.
+ */
+static bool
+seq_chunk_scan(struct source_info *ifp)
+{
+	while (ifp->seq_data_end < ifp->source_pos_read) {
+		off_t end;
+
+		if (pool_byte(ifp->bp, ifp->seq_data_end) == SEQ_TAG)
+			return true;
+		end = record_find_forward(ifp->bp, ifp->seq_data_end,
+			ifp->source_pos_read);
+		if (end == -1) {
+			if (!ifp->reached_eof)
+				return false;
+			/* Unterminated final record */
+			ifp->seq_data_end = ifp->source_pos_read;
+			break;
+		}
+		ifp->seq_data_end = end + 1;
+	}
+	return ifp->reached_eof;
+}
+
+/*
+ * Append the inputs' chunks to the gathered source in the order of
+ * their sequence tags, until the data of the next chunk or memory for
+ * storing them are not available.
+ * A chunk's data are appended as they arrive; the following chunks
+ * remain buffered in their inputs' pools.
+ * Set the gathered source's reached_eof when all chunks have been
+ * gathered.
+ */
+static void
+seq_records(struct source_info *ifiles)
+{
+	struct source_info *ifp;
+
+	for (;;) {
+		struct source_info *next = NULL;
+		long long min_seq = -1;
+		bool unknown = false;
+
+		for (ifp = ifiles; ifp; ifp = ifp->next) {
+			if (ifp->chunk_seq == -1)
+				seq_tag_read(ifp);
+			if (ifp->chunk_seq == -1) {
+				if (!merge_exhausted(ifp))
+					unknown = true;
+				continue;
+			}
+			if (ifp->chunk_seq == gather_seq) {
+				next = ifp;
+				break;
+			}
+			if (min_seq == -1 || ifp->chunk_seq < min_seq)
+				min_seq = ifp->chunk_seq;
+		}
+		if (next == NULL) {
+			if (unknown)
+				break;
+			if (min_seq == -1) {
+				gather_ifp->reached_eof = true;
+				DPRINTF(3, "Gathered %lld chunks", gather_seq);
+				break;
+			}
+			/* Skip chunks that were lost, e.g. by a terminated sink. */
+			gather_seq = min_seq;
+			continue;
+		}
+
+		if (!seq_chunk_scan(next)) {
+			(void)gather_copy(gather_ifp, next, next->seq_data_end);
+			break;
+		}
+		if (!gather_copy(gather_ifp, next, next->seq_data_end))
+			break;
+		next->chunk_seq = -1;
+		gather_seq++;
+	}
+
+	/* Prefer reading the inputs on which gathering depends. */
+	for (ifp = ifiles; ifp; ifp = ifp->next)
+		ifp->merge_needed = !merge_exhausted(ifp) &&
+			(ifp->chunk_seq == -1 || ifp->chunk_seq == gather_seq);
+}
+
+/*
+ * Append the records of the inputs from the position up to which they
+ * have been gathered, up to the end of their last complete record,
+ * to the gathered source, cycling over the inputs,
+ * until the records or memory for storing them are not available.
+ * The records of one input are appended in their entirety before
+ * another input's, so that records are never interleaved.
+ * Set the gathered source's reached_eof when all records have been
+ * gathered.
+ */
+static void
+any_records(struct source_info *ifiles)
+{
+	struct source_info *ifp;
+	struct io_buffer b;
+	bool exhausted = true;
+
+	for (ifp = ifiles; ifp; ifp = ifp->next) {
+		if (any_ifp == NULL) {
+			off_t end;
+
+			if (merge_exhausted(ifp))
+				continue;
+			exhausted = false;
+			end = record_find_backward(ifp->bp,
+				MAX(ifp->merge_pos, ifp->merge_scanned),
+				ifp->source_pos_read);
+			if (end != -1)
+				end++;
+			else if (ifp->reached_eof)
+				end = ifp->source_pos_read;
+			else {
+				/* Avoid searching the same data again. */
+				ifp->merge_scanned = ifp->source_pos_read;
+				continue;
+			}
+			any_ifp = ifp;
+			any_end = end;
+			any_terminate = pool_byte(ifp->bp, end - 1) != rt;
+		}
+		exhausted = false;
+		if (!gather_copy(gather_ifp, any_ifp, any_end))
+			return;
+		if (any_terminate) {
+			if (!source_buffer(gather_ifp, &b))
+				return;
+			*(char *)b.p = rt;
+			gather_ifp->source_pos_read++;
+		}
+		/* Continue with the inputs following a completed one. */
+		ifp = any_ifp;
+		any_ifp = NULL;
+	}
+	if (exhausted) {
+		gather_ifp->reached_eof = true;
+		DPRINTF(3, "Gathered all records");
+	}
+}
+
+/* Gather the inputs' records according to the specified gather mode */
+static void
+gather_records(struct source_info *ifiles)
+{
+	switch (gather_mode) {
+	case gm_merge:
+		merge_records();
+		break;
+	case gm_seq:
+		seq_records(ifiles);
+		break;
+	case gm_any:
+		any_records(ifiles);
+		break;
+	case gm_concatenate:
+		break;
+	}
+}
+
+/*
+ * Return true if the specified input should be read while gathering.
+ * Inputs that run ahead of the others are read only while their
+ * buffered data are below half the memory limit, thereby
+ * applying backpressure on them.
+ */
+static bool
+gather_reads(struct source_info *ifp)
+{
+	return ifp->merge_needed ||
+		(unsigned long)(ifp->source_pos_read - ifp->merge_pos) < max_mem / 2;
+}
+
+/*
+ * Set up the gathering of the specified inputs into a source,
+ * which the sinks read.  All inputs are read concurrently.
+ */
+static void
+gather_setup(struct source_info *ifiles)
+{
+	struct source_info *ifp;
+	int n = 0;
+
+	for (ifp = ifiles; ifp; ifp = ifp->next) {
+		ifp->active = true;
+		ifp->chain_last = true;
+		ifp->ordinal = n++;
+	}
+	if (gather_mode == gm_seq) {
+		for (ifp = ifiles; ifp; ifp = ifp->next)
+			ifp->merge_needed = true;
+		gather_ifp = new_source_info("sequenced input");
+		gather_ifp->fd = -1;
+		return;
+	}
+	if (gather_mode == gm_any) {
+		gather_ifp = new_source_info("gathered input");
+		gather_ifp->fd = -1;
+		return;
+	}
+	merge_heap = (struct source_info **)malloc(n * sizeof(struct source_info *));
+	merge_waiting = (struct source_info **)malloc(n * sizeof(struct source_info *));
+	if (merge_heap == NULL || merge_waiting == NULL)
+		err(1, NULL);
+	for (ifp = ifiles; ifp; ifp = ifp->next) {
+		ifp->merge_needed = true;
+		merge_waiting[merge_waiting_n++] = ifp;
+	}
+	gather_ifp = new_source_info("merged input");
+	gather_ifp->fd = -1;
+}
+
+/* FNV-1a hash function parameters */
+#define HASH_BASIS 14695981039346656037ULL
+#define HASH_PRIME 1099511628211ULL
+
+/* Return the hash h extended with the n bytes at p */
+static uint64_t
+hash_bytes(uint64_t h, const void *p, size_t n)
+{
+	const unsigned char *s = p;
+
+	while (n--) {
+		h ^= *s++;
+		h *= HASH_PRIME;
+	}
+	return h;
+}
+
+/*
+ * Return the hash of the keys of the record [p, e), which excludes its
+ * terminator, or of the whole record if no keys were specified.
+ * Numeric keys are hashed on their significant digits, so that records
+ * whose keys compare equal when merging are routed to the same partition.
+ */
+static uint64_t
+record_hash(const char *p, const char *e)
+{
+	uint64_t h = HASH_BASIS;
+	int i;
+
+	if (nsort_keys == 0)
+		return hash_bytes(h, p, e - p);
+	for (i = 0; i < nsort_keys; i++) {
+		const struct sort_key *k = &sort_keys[i];
+		const char *ks = field_start(p, e, k->field_begin);
+
+		if (k->numeric) {
+			struct number n;
+
+			number_parse(ks, e, &n);
+			h = hash_bytes(h, "-", n.negative);
+			h = hash_bytes(h, n.int_begin, n.int_end - n.int_begin);
+			h = hash_bytes(h, ".", 1);
+			h = hash_bytes(h, n.frac_begin,
+				n.frac_end - n.frac_begin);
+		} else {
+			const char *kend = key_end(p, e, k);
+
+			h = hash_bytes(h, ks, MAX(kend - ks, 0));
+		}
+		/* Separate the keys */
+		h = hash_bytes(h, "", 1);
+	}
+	return h;
+}
+
+/*
+ * Copy the record [pos, end) of the specified pool to dst, which must
+ * hold end - pos + 1 bytes, replacing its terminator with a NUL.
+ * Return the record's length without its terminator.
+ */
+static size_t
+record_copy(struct buffer_pool *bp, off_t pos, off_t end, char *dst)
+{
+	size_t len = end - pos;
+	char *p = dst;
+
+	while (pos < end) {
+		size_t n = sink_buffer_length(pos, end);
+
+		memcpy(p, sink_pointer(bp, pos), n);
+		p += n;
+		pos += n;
+	}
+	if (len && dst[len - 1] == rt)
+		len--;
+	dst[len] = '\0';
+	return len;
+}
+
+/* Order records on their keys; qsort(3) helper */
+static int
+record_qsort_compare(const void *a, const void *b)
+{
+	const struct record *ra = a, *rb = b;
+
+	return record_compare(ra->p, ra->p + ra->len, rb->p, rb->p + rb->len);
+}
+
+/*
+ * Choose the splitters of the partitions' key ranges from the records
+ * in the first part of the specified input, so that the partitions
+ * receive about the same number of records.
+ * Return false if the input's sample is not yet available.
+ */
+static bool
+range_splitters(struct source_info *ifp)
+{
+	struct record *sample = NULL;
+	size_t nsample = 0, sample_size = 0, available, i;
+	off_t pos, end, limit;
+
+	/* Inputs being partitioned are read up to half the memory limit. */
+	available = ifp->source_pos_read - ifp->merge_pos;
+	if (!ifp->reached_eof && available < MIN(range_sample, max_mem / 2))
+		return false;
+	limit = ifp->merge_pos + MIN(range_sample, available);
+
+	for (pos = ifp->merge_pos; pos < limit; pos = end) {
+		end = record_find_forward(ifp->bp, pos, limit);
+		if (end != -1)
+			end++;
+		else if (limit == ifp->source_pos_read && ifp->reached_eof)
+			end = limit;
+		else
+			break;
+		if (nsample == sample_size) {
+			sample_size = sample_size ? sample_size * 2 : 256;
+			if ((sample = (struct record *)realloc(sample,
+			    sample_size * sizeof(struct record))) == NULL)
+				err(1, NULL);
+		}
+		if ((sample[nsample].p = (char *)malloc(end - pos + 1)) == NULL)
+			err(1, NULL);
+		sample[nsample].len = record_copy(ifp->bp, pos, end, sample[nsample].p);
+		nsample++;
+	}
+	qsort(sample, nsample, sizeof(struct record), record_qsort_compare);
+
+	/* The splitters are the sample's quantiles. */
+	nsplitters = nsample ? npartitions - 1 : 0;
+	if ((splitters = (struct record *)malloc(nsplitters * sizeof(struct record))) == NULL &&
+	    nsplitters)
+		err(1, NULL);
+	for (i = 0; i < (size_t)nsplitters; i++) {
+		struct record *r = &sample[(i + 1) * nsample / npartitions];
+
+		splitters[i].len = r->len;
+		if ((splitters[i].p = strdup(r->p)) == NULL)
+			err(1, NULL);
+		DPRINTF(3, "Splitter %zu: [%s]", i, r->p);
+	}
+	for (i = 0; i < nsample; i++)
+		free(sample[i].p);
+	free(sample);
+	DPRINTF(3, "Chose %d splitters from %zu sampled records", nsplitters, nsample);
+	splitters_chosen = true;
+	return true;
+}
+
+/*
+ * Return the partition to which the input's record that starts at the
+ * position up to which it has been partitioned and ends at end
+ * is routed.
+ */
+static int
+record_partition(struct source_info *ifp, off_t end)
+{
+	off_t pos = ifp->merge_pos;
+	size_t len = end - pos;
+	const char *p;
+	int lo, hi;
+
+	if (scatter_policy == sp_hash && sink_buffer_length(pos, end) == len) {
+		p = sink_pointer(ifp->bp, pos);
+		if (p[len - 1] == rt)
+			len--;
+	} else {
+		/* Make the record contiguous, and end its numbers. */
+		if (len + 1 > partition_record_size) {
+			partition_record_size = len + 1;
+			if ((partition_record = (char *)realloc(partition_record,
+			    partition_record_size)) == NULL)
+				err(1, NULL);
+		}
+		len = record_copy(ifp->bp, pos, end, partition_record);
+		p = partition_record;
+	}
+	if (scatter_policy == sp_hash)
+		return record_hash(p, p + len) % npartitions;
+
+	/* Find the first splitter greater than the record. */
+	for (lo = 0, hi = nsplitters; lo < hi; ) {
+		int mid = (lo + hi) / 2;
+
+		if (record_compare(p, p + len, splitters[mid].p,
+		    splitters[mid].p + splitters[mid].len) < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+/*
+ * Return true if the specified partition holds its share of the memory
+ * limit, so that records routed to it must wait for its sink.
+ * With a temporary file, its data are paged out instead.
+ */
+static bool
+partition_full(struct source_info *pp)
+{
+	return !use_tmp_file &&
+		memory_pool_size(pp->bp, pp->bp->allocated_pool_end - 1) >=
+		MAX(max_mem / npartitions, (unsigned long)buffer_size);
+}
+
+/*
+ * Route the records of the scattered inputs to the partitions
+ * according to the hash or range of their keys, until the next record
+ * or memory for storing it in its partition are not available.
+ * Records routed to a sink that has been closed are discarded.
+ * Set the partitions' reached_eof when all records have been routed.
+ */
+static void
+partition_records(void)
+{
+	struct source_info *ifp;
+	int i;
+
+	if (scatter_policy == sp_range && !splitters_chosen &&
+	    !range_splitters(partition_ifp))
+		return;
+	for (;;) {
+		ifp = partition_ifp;
+		if (partition_dest == NULL) {
+			off_t end;
+
+			if (merge_exhausted(ifp)) {
+				if (ifp->chain_last) {
+					for (i = 0; i < npartitions; i++)
+						partitions[i]->reached_eof = true;
+					DPRINTF(3, "Partitioned all records");
+					return;
+				}
+				partition_ifp = ifp->next;
+				continue;
+			}
+			end = record_find_forward(ifp->bp,
+				MAX(ifp->merge_pos, ifp->merge_scanned),
+				ifp->source_pos_read);
+			if (end != -1)
+				end++;
+			else if (ifp->reached_eof)
+				end = ifp->source_pos_read;
+			else {
+				/* Avoid searching the same data again. */
+				ifp->merge_scanned = ifp->source_pos_read;
+				return;
+			}
+			i = record_partition(ifp, end);
+			if (!partition_sinks[i]->active) {
+				ifp->merge_pos = end;
+				memory_free(ifp->bp, ifp->merge_pos);
+				continue;
+			}
+			partition_dest = partitions[i];
+			partition_end = end;
+		}
+		if (partition_full(partition_dest) ||
+		    !gather_copy(partition_dest, ifp, partition_end))
+			return;
+		partition_dest = NULL;
+	}
+}
+
+/*
+ * Set up the partitioning of the records of the specified chain of
+ * scattered inputs into a source for each of the specified sinks,
+ * which they read.
+ * Return the partitions as a list of sources.
+ */
+static struct source_info *
+partition_setup(struct source_info *ifiles, struct sink_info *ofiles)
+{
+	struct source_info *list = NULL, **end = &list;
+	struct sink_info *ofp;
+	char name[32];
+	int i;
+
+	for (ofp = ofiles; ofp; ofp = ofp->next)
+		npartitions++;
+	partitions = (struct source_info **)malloc(npartitions * sizeof(struct source_info *));
+	partition_sinks = (struct sink_info **)malloc(npartitions * sizeof(struct sink_info *));
+	if (partitions == NULL || partition_sinks == NULL)
+		err(1, NULL);
+	for (ofp = ofiles, i = 0; ofp; ofp = ofp->next, i++) {
+		snprintf(name, sizeof(name), "partition %d", i + 1);
+		partitions[i] = new_source_info(name);
+		partitions[i]->fd = -1;
+		partitions[i]->active = true;
+		partitions[i]->chain_last = true;
+		partition_sinks[i] = ofp;
+		ofp->ifp = partitions[i];
+		*end = partitions[i];
+		end = &partitions[i]->next;
+	}
+	partition_ifp = ifiles;
+	return list;
+}
+
+/*
+ * Return true if a record of the specified length passes the
+ * sampling or rate limit of the specified lossy sink.
+ */
+static bool
+lossy_keep(struct sink_info *ofp, size_t len)
+{
+	switch (ofp->policy) {
+	case op_sample:
+		return ofp->records_seen % ofp->policy_arg == 0;
+	case op_rate:
+		/* A full allowance also passes records longer than it. */
+		return len <= ofp->rate_allowance ||
+			ofp->rate_allowance >= ofp->policy_arg;
+	default:
+		return true;
+	}
+}
+
+/*
+ * Allocate to an idle lossy sink the run of whole records following
+ * its written position that pass its policy, dropping those that don't.
+ */
+static void
+lossy_allocate(struct sink_info *ofp)
+{
+	struct source_info *ifp = ofp->ifp;
+	off_t pos = ofp->pos_written, start = -1, rec_end;
+	size_t len;
+	bool keep;
+
+	if (ofp->pos_written != ofp->pos_to_write)
+		return;
+	if (ofp->policy == op_rate) {
+		double now = time_now();
+
+		if (ofp->rate_time != 0)
+			ofp->rate_allowance = MIN(ofp->policy_arg, ofp->rate_allowance +
+				(now - ofp->rate_time) * ofp->policy_arg);
+		ofp->rate_time = now;
+	}
+	while (pos < ifp->source_pos_read) {
+		rec_end = record_find_forward(ifp->bp, pos, ifp->source_pos_read);
+		if (rec_end == -1) {
+			if (!ifp->reached_eof)
+				break;
+			/* Unterminated final record */
+			rec_end = ifp->source_pos_read - 1;
+		}
+		len = rec_end + 1 - pos;
+		if (ofp->record_skip) {
+			/* Remainder of a record dropped while lagging */
+			ofp->record_skip = false;
+			keep = false;
+		} else {
+			keep = lossy_keep(ofp, len);
+			/* Decide on the record after the run is written. */
+			if (!keep && start != -1)
+				break;
+			ofp->records_seen++;
+		}
+		if (keep) {
+			if (start == -1)
+				start = pos;
+			if (ofp->policy == op_rate)
+				ofp->rate_allowance -= len;
+		} else
+			ofp->bytes_dropped += len;
+		pos = rec_end + 1;
+	}
+	ofp->pos_written = start == -1 ? pos : start;
+	ofp->pos_to_write = pos;
+}
+
+/*
+ * Copy into the sink's held data the pool data [start, end),
+ * so that the buffers storing them can be freed.
+ */
+static void
+sink_hold(struct sink_info *ofp, off_t start, off_t end)
+{
+	size_t pending = ofp->held_len - ofp->held_written;
+	size_t len;
+
+	if (pending + (end - start) > ofp->held_size) {
+		ofp->held_size = pending + (end - start);
+		if ((ofp->held = realloc(ofp->held, ofp->held_size)) == NULL)
+			err(1, NULL);
+	}
+	if (pending)
+		memmove(ofp->held, ofp->held + ofp->held_written, pending);
+	ofp->held_len = pending;
+	ofp->held_written = 0;
+	for (; start < end; start += len) {
+		len = sink_buffer_length(start, end);
+		memcpy(ofp->held + ofp->held_len, sink_pointer(ofp->ifp->bp, start), len);
+		ofp->held_len += len;
+	}
+}
+
+/*
+ * Prevent a lossy sink from holding back the freeing of buffers
+ * that the other sinks reading its source have written.
+ * The sink may lag behind the data read by a share of the memory
+ * limit, unless no more memory can be allocated for reading.
+ * A lagging sink that is writing a record keeps its rest in the
+ * held data, and skips to the first record that starts in the
+ * buffers that are kept.
+ * (An idle sink only lags if it has skipped data; otherwise it is
+ * waiting for the remainder of a record.)
+ * Update the source's read_min_pos with the sink's position.
+ */
+static void
+lossy_lag(struct sink_info *ofp)
+{
+	struct source_info *ifp = ofp->ifp;
+	struct buffer_pool *bp = ifp->bp;
+	off_t kept = ifp->read_min_pos;
+	off_t pos, rec_end;
+
+	if (memory_pool_size(bp, bp->allocated_pool_end) <= max_mem &&
+	    graph_available(1))
+		kept = MIN(kept, ifp->source_pos_read -
+			(off_t)(max_mem / LOSSY_LAG_SHARE));
+	kept = MAX(kept, 0) / buffer_size * buffer_size;
+
+	if (ofp->pos_written >= kept) {
+		ifp->read_min_pos = MIN(ifp->read_min_pos, ofp->pos_written);
+		return;
+	}
+	if (ofp->pos_written < ofp->pos_to_write) {
+		rec_end = record_find_forward(ifp->bp, ofp->pos_written,
+			ofp->pos_to_write);
+		if (rec_end == -1)
+			/* Unterminated final record */
+			rec_end = ofp->pos_to_write - 1;
+		sink_hold(ofp, ofp->pos_written, rec_end + 1);
+		ofp->pos_written = rec_end + 1;
+		if (ofp->pos_written >= kept) {
+			ifp->read_min_pos = MIN(ifp->read_min_pos, ofp->pos_written);
+			return;
+		}
+		/* Drop the rest of the run below. */
+		ofp->pos_to_write = ofp->pos_written;
+		ofp->record_skip = false;
+	}
+	rec_end = record_find_forward(ifp->bp, ofp->pos_written,
+		ifp->source_pos_read);
+	if (rec_end == -1 && !ofp->record_skip) {
+		/* The sink is waiting for the end of its next record. */
+		ifp->read_min_pos = MIN(ifp->read_min_pos, ofp->pos_written);
+		return;
+	}
+	if (rec_end != -1 && rec_end < kept - 1)
+		rec_end = record_find_forward(ifp->bp, kept - 1,
+			ifp->source_pos_read);
+	if (rec_end == -1) {
+		pos = kept;
+		ofp->record_skip = true;
+	} else {
+		pos = rec_end + 1;
+		ofp->record_skip = false;
+	}
+	DPRINTF(4, "Lagging sink %s drops %ld bytes", fp_name(ofp),
+		(long)(pos - ofp->pos_written));
+	ofp->bytes_dropped += pos - ofp->pos_written;
+	ofp->pos_written = ofp->pos_to_write = pos;
+	ifp->read_min_pos = MIN(ifp->read_min_pos, pos);
+}
+
+/*
+ * Allocate available read data to empty sinks that can be written to,
+ * by adjusting their ifp, pos_written, and pos_to_write pointers.
+ */
+static void
+allocate_data_to_sinks(struct sink_info *files)
+{
+	struct sink_info *ofp;
+	int available_sinks = 0;
+	off_t pos_assigned = 0;
+	size_t available_data, data_to_assign;
+	bool use_reliable = false;
+
+	/* Easy case: distribute to all files, or their partitions. */
+	if (!opt_scatter || partitioning()) {
+		for (ofp = files; ofp; ofp = ofp->next) {
+			/* Advance to next input file, if required */
+			if (ofp->pos_written == ofp->ifp->source_pos_read &&
+			    ofp->ifp->reached_eof &&
+			    !ofp->ifp->chain_last) {
+				DPRINTF(4, "%s(): advance to input file %s\n",
+						__func__, fp_name(ofp->ifp));
+				ofp->ifp = ofp->ifp->next;
+				ofp->ifp->active = true;
+				ofp->pos_written = 0;
+			}
+			if (ofp->policy == op_all)
+				ofp->pos_to_write = ofp->ifp->source_pos_read;
+			else
+				lossy_allocate(ofp);
+		}
+		return;
+	}
+
+	/*
+	 * Difficult case: scattering across available sinks
+	 * according to the scatter policy.
+	 * The input files are chained together, and scattered in sequence.
+	 */
+	if (scatter_ifp == NULL)
+		scatter_ifp = files->ifp;
+
+	if (scatter_policy == sp_rate) {
+		double now = time_now();
+
+		for (ofp = files; ofp; ofp = ofp->next)
+			if (ofp->active)
+				drain_rate_update(ofp, now);
+	}
+
+	/* Determine the position up to which data has been assigned. */
+	for (ofp = files; ofp; ofp = ofp->next)
+		if (ofp->ifp == scatter_ifp)
+			pos_assigned = MAX(pos_assigned, ofp->pos_to_write);
+
+	/* Advance to the next input file, if all data have been assigned. */
+	while (scatter_ifp->reached_eof && !scatter_ifp->chain_last &&
+	    pos_assigned == scatter_ifp->source_pos_read) {
+		scatter_ifp = scatter_ifp->next;
+		scatter_ifp->active = true;
+		pos_assigned = 0;
+		DPRINTF(4, "%s(): advance to input file %s\n",
+				__func__, fp_name(scatter_ifp));
+	}
+
+	/*
+	 * Determine the number of available sinks, moving those that have
+	 * written all their data to the position assigned so far,
+	 * so that they do not hold back the freeing of buffers.
+	 */
+	for (ofp = files; ofp; ofp = ofp->next) {
+		if (ofp->pos_written != ofp->pos_to_write)
+			continue;
+		ofp->ifp = scatter_ifp;
+		ofp->pos_written = ofp->pos_to_write = pos_assigned;
+		if (fp_ready(ofp))
+			available_sinks++;
+	}
+
+	/*
+	 * The available data can span multiple pool buffers;
+	 * record boundaries are searched across them.
+	 */
+	available_data = scatter_ifp->source_pos_read - pos_assigned;
+
+	if (available_sinks == 0)
+		return;
+
+	/* Divide the data among the sinks. */
+	if (block_len == 0)
+		scatter_shares(files, available_data, 1);
+	else {
+		/* Divide whole blocks; only the input's final block can be shorter. */
+		size_t nblocks = available_data / block_len;
+
+		if (scatter_ifp->reached_eof && available_data % block_len)
+			nblocks++;
+		scatter_shares(files, nblocks, block_len);
+	}
+
+	/* Assign data to sinks. */
+	for (ofp = files; ofp; ofp = ofp->next) {
+		/* Move to next file if this has data to write, or isn't ready. */
+		if (ofp->pos_written != ofp->pos_to_write || !fp_ready(ofp))
+			continue;
+		/* Sinks that are behind others get no data under uneven policies. */
+		if (ofp->scatter_share == 0 && scatter_policy != sp_equal)
+			continue;
+
+		data_to_assign = ofp->scatter_share * (block_len ? block_len : 1);
+		DPRINTF(4, "pos_assigned=%ld source_pos_read=%ld available_data=%ld available_sinks=%d data_to_assign=%ld",
+			(long)pos_assigned, (long)ofp->ifp->source_pos_read, (long)available_data, available_sinks, (long)data_to_assign);
+		/*
+		 * Assign data_to_assign to *ofp (pos_written, pos_to_write),
+		 * and advance pos_assigned.
+		 */
+		ofp->pos_written = pos_assigned;		/* Initially nothing has been written. */
+		if (block_len == 0) {			/* Write whole lines */
+			if (available_data > buffer_size / 2 && !use_reliable) {
+				/*
+				 * Efficient algorithm:
+				 * Assume that multiple lines appear in data_to_assign.
+				 * Go to a calculated boundary and scan backward to find
+				 * a new line.
+				 */
+				off_t data_end = record_find_backward(ofp->ifp->bp,
+					pos_assigned + 1, pos_assigned + data_to_assign);
+
+				if (data_end == -1) {
+					/*
+					 * If no newline was found with backward scanning
+					 * degenerate to the efficient algorithm. This will
+					 * scan further forward, and can defer writing the
+					 * last chunk, until more data is read.
+					 */
+					use_reliable = true;
+					goto reliable;
+				}
+				pos_assigned = data_end + 1;
+			} else {
+				/*
+				 * Reliable algorithm:
+				 * Scan forward for a new line after at least
+				 * data_to_assign are covered.
+				 * If we reach the end of the available data,
+				 * backtrack to the last new line before it.
+				 */
+				off_t data_end, source_end;
+
+			reliable:
+				source_end = ofp->ifp->source_pos_read;
+				data_end = -1;
+				if (pos_assigned + (off_t)data_to_assign + 1 < source_end)
+					data_end = record_find_forward(ofp->ifp->bp,
+						pos_assigned + data_to_assign + 1, source_end);
+				if (data_end == -1)
+					data_end = record_find_backward(ofp->ifp->bp,
+						pos_assigned, MIN(pos_assigned + (off_t)data_to_assign + 1, source_end));
+				if (data_end == -1 && ofp->ifp->reached_eof)
+					/* Unterminated final record */
+					data_end = source_end - 1;
+				if (data_end == -1) {
+					/* No newline found in buffer; defer writing. */
+					ofp->pos_to_write = pos_assigned;
+					DPRINTF(4, "scatter to file[%s] no newline from %ld to %ld",
+						fp_name(ofp), (long)pos_assigned, (long)source_end);
+					return;
+				}
+				pos_assigned = data_end + 1;
+			}
+		} else
+			/* Write whole blocks, without examining the data. */
+			pos_assigned = MIN(pos_assigned + (off_t)data_to_assign,
+				ofp->ifp->source_pos_read);
+		ofp->pos_to_write = pos_assigned;
+		if (opt_seq_tags && ofp->pos_to_write > ofp->pos_written) {
+			ofp->tag_len = snprintf(ofp->tag, sizeof(ofp->tag), "%c%lld%c",
+				SEQ_TAG, scatter_seq++, rt);
+			ofp->tag_written = 0;
+		}
+		DPRINTF(4, "scatter to file[%s] pos_written=%ld pos_to_write=%ld data=[%.*s]",
+			fp_name(ofp), (long)ofp->pos_written, (long)ofp->pos_to_write,
+			(int)(ofp->pos_to_write - ofp->pos_written) * DATA_DUMP, sink_pointer(ofp->ifp->bp, ofp->pos_written));
+	}
+}
+
+
+/*
+ * Write out from the memory buffer to the sinks where write will not block.
+ * Free memory no more needed even by the write pointer farthest behind.
+ * Return the number of bytes written.
+ */
+static size_t
+sink_write(struct source_info *ifiles, struct sink_info *ofiles)
+{
+	struct sink_info *ofp;
+	struct source_info *ifp;
+	size_t written = 0;
+	bool chain_read = false;
+
+	for (ifp = ifiles; ifp; ifp = ifp->next) {
+		ifp->read_min_pos = ifp->source_pos_read;
+		ifp->is_read = false;
+	}
+
+	allocate_data_to_sinks(ofiles);
+	for (ofp = ofiles; ofp; ofp = ofp->next) {
+		DPRINTF(4, "\n%s(): try write to file %s", __func__, fp_name(ofp));
+		while (ofp->active && fp_ready(ofp)) {
+			ssize_t n;
+			struct iovec iov[IOV_MAX];
+			int iovcnt;
+
+			iovcnt = sink_iovec(ofp, iov);
+			DPRINTF(4, "\n%s(): sink iovec returned %d buffers to write",
+					__func__, iovcnt);
+			if (iovcnt == 0)
+				/* Can happen when a line spans a buffer */
+				n = 0;
+			else {
+				n = sink_transfer(ofp, sink_copy_source(ofp),
+					ofp->pos_written, iov, iovcnt);
+				ofp->writes++;
+				if (n < 0)
+					switch (errno) {
+					/* EPIPE is acceptable, for the sink's reader can terminate early. */
+					case EPIPE:
+						ofp->active = false;
+						(void)close(ofp->fd);
+						DPRINTF(4, "EPIPE for %s", fp_name(ofp));
+						break;
+					case EAGAIN:
+						DPRINTF(4, "EAGAIN for %s", fp_name(ofp));
+						ofp->ready = false;
+						sink_blocked(ofp, true);
+						n = 0;
+						break;
+					default:
+						err(2, "Error writing to %s", fp_name(ofp));
+					}
+				else {
+					sink_blocked(ofp, false);
+					sink_written(ofp, n);
+					written += n;
+				}
+			}
+			DPRINTF(4, "Wrote %ld bytes from %d buffers for file %s pos_written=%lu data=[%.*s]",
+				(long)n, iovcnt, fp_name(ofp), (unsigned long)ofp->pos_written,
+				(int)MIN(n, iovcnt ? iov[0].iov_len : 0) * DATA_DUMP,
+				iovcnt ? (char *)iov[0].iov_base : "");
+			/* Lossy sinks continue with their next run of records. */
+			if (ofp->policy == op_all || n <= 0 || sink_pending(ofp))
+				break;
+			lossy_allocate(ofp);
+			if (ofp->pos_written == ofp->pos_to_write)
+				break;
+		}
+		if (ofp->active) {
+			if (ofp->policy == op_all)
+				ofp->ifp->read_min_pos = MIN(ofp->ifp->read_min_pos, ofp->pos_written);
+			ofp->ifp->is_read = true;
+		}
+	}
+
+	/* Lossy sinks are positioned after the others have been accounted. */
+	for (ofp = ofiles; ofp; ofp = ofp->next)
+		if (ofp->active && ofp->policy != op_all)
+			lossy_lag(ofp);
+
+	/* Free buffers all sinks have read */
+	for (ifp = ifiles; ifp; ifp = ifp->next) {
+		if (!chain_read)
+			memory_free(ifp->bp, ifp->read_min_pos);
+		/*
+		 * We are reading this source, so don't even think freeing
+		 * the sources chained after it.
+		 */
+		if (ifp->is_read)
+			chain_read = true;
+		if (ifp->chain_last)
+			chain_read = false;
+	}
+
+	DPRINTF(4, "Wrote %zu total bytes", written);
+	return written;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "Usage %s [-b size] [-g mode] [-i file] [-CHIMqsz] [-j n] [-k key] [-L policy] [-l size] [-o file] [-m size] [-P size] [-S policy] [-t char]\n"
+		"-a"		"\tOpen output file(s) for appending\n"
+		"-b size"	"\tSpecify the size of the buffer to use (used for stress testing)\n"
+		"-C"		"\tCompress the data overflowing into the temporary file\n"
+		"-f"		"\tOverflow buffered data into a temporary file\n"
+		"-g mode"	"\tGather the inputs by concatenating, merging, or sequencing them,\n"
+		"\t\tor as their records arrive (concatenate, merge, seq, any)\n"
+		"-H"		"\tBack buffers with huge pages\n"
+		"-I"		"\tInput-side buffering\n"
+		"-i file"	"\tGather input from specified file\n"
+		"-j n"		"\tWrite to the outputs through n threads\n"
+		"-k key"	"\tMerge or partition on the specified sort(1)-style key\n"
+		"-L policy"	"\tDeliver all, drop lagging, sampled, or rate-limited records\n"
+		"\t\tto the subsequent -o files (all, drop, sample=N, rate=size)\n"
+		"-l size[k|M|G]""\tScatter the input in blocks of the specified size\n"
+		"-m size[k|M|G]""\tSpecify the maximum buffer memory size\n"
+		"-M"		"\tProvide memory use statistics on termination\n"
+		"-o file"	"\tScatter output to specified file\n"
+		"-P size[k|M|G]""\tRaise pipe capacities and adapt read sizes up to size\n"
+		"-p d1[,d2...]"	"\tPermute inputs to specified outputs\n"
+		"-q"		"\tTag scattered chunks with sequence numbers for -g seq\n"
+		"-s"		"\tScatter the input across the files, rather than copying it to all\n"
+		"-S policy"	"\tDivide scattered data equally, by outstanding data, by drain rate,\n"
+		"\t\tby the hash or sampled range of the -k keys, or as contiguous\n"
+		"\t\tparts of a regular file\n"
+		"\t\t(equal, outstanding, rate, hash, range[=size], split)\n"
+		"-T dir"	"\tSpecify directory for storing temporary file\n"
+		"-t char"	"\tProcess char-terminated records (newline default)\n"
+		"-z"		"\tTransfer data between pipes without copying it\n",
+		name);
+	exit(1);
+}
+
+/*
+ * Set the specified file descriptor to operate in non-blocking
+ * mode.
+ * It seems that even if select returns for a specified file
+ * descriptor, performing I/O to it may block depending on the
+ * amount of data specified.
+ * See See http://pubs.opengroup.org/onlinepubs/009695399/functions/write.html#tag_03_866
+ */
+static void
+non_block(int fd, const char *name)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0)
+		err(2, "Error getting flags for %s", name);
+	if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		err(2, "Error setting %s to non-blocking mode", name);
+}
+
+/*
+ * Start the helper thread that performs temporary file I/O
+ * for the specified sinks.
+ */
+static void
+page_setup(struct sink_info *ofiles)
+{
+	pthread_t thread;
+	int e;
+
+	page_sinks = ofiles;
+	if (opt_compress && (page_compressed = malloc(buffer_size)) == NULL)
+		err(1, NULL);
+	if (pipe(page_notify) < 0)
+		err(2, "Error creating paging notification pipe");
+	non_block(page_notify[0], "paging notification pipe");
+	non_block(page_notify[1], "paging notification pipe");
+	if ((e = pthread_create(&thread, NULL, page_worker, NULL)) != 0) {
+		errno = e;
+		err(2, "Error creating paging thread");
+	}
+}
+
+/*
+ * Show the sources and sinks the event loop waits for in human-readable
+ * form, marking with a * those that are ready for I/O.
+ * If check is true, abort the program if the loop waits for none.
+ */
+static void
+show_wait_args(const char *msg, struct source_info *ifiles, struct sink_info *ofiles, bool check)
+{
+	#ifdef DEBUG
+	struct sink_info *ofp;
+	struct source_info *ifp;
+	int nwait = 0;
+
+	fprintf(stderr, "%s: ", msg);
+	for (ifp = ifiles; ifp; ifp = ifp->next)
+		if (ifp->wait) {
+			fprintf(stderr, "%s%s ", fp_name(ifp), ifp->ready ? "*" : "");
+			nwait++;
+		}
+	for (ofp = ofiles; ofp; ofp = ofp->next)
+		if (ofp->wait) {
+			fprintf(stderr, "%s%s ", fp_name(ofp), ofp->ready ? "*" : "");
+			nwait++;
+		}
+	if (page_jobs) {
+		fprintf(stderr, "paging%s ", page_ready ? "*" : "");
+		nwait++;
+	}
+	fputc('\n', stderr);
+	if (check && nwait == 0)
+		abort();
+	#endif
+}
+
+#ifdef __linux__
+/*
+ * The event loop is based on edge-triggered epoll(7).
+ * All sources and sinks are registered once, and the kernel reports
+ * only changes in their readiness, setting their ready flag.
+ * The flag is cleared when an I/O operation returns EAGAIN.
+ * Sinks remain registered for EPOLLOUT, and thus also generate an event
+ * when their readers drain them while they have no pending data; such
+ * an event only sets the flag.
+ * The cost of waiting is proportional to the number of events, rather
+ * than to the number of file descriptors, which is also not limited by
+ * FD_SETSIZE.
+ * However, each iteration of the event loop still examines all sources
+ * and sinks, to mark those it waits for and to write to those that are
+ * ready, so its cost remains proportional to their number.
+ * Only the kernel's work of building and scanning descriptor sets
+ * on every wait is avoided.
+ */
+
+/* File descriptor of the event loop's epoll instance */
+static int epoll_fd = -1;
+
+/*
+ * Register the specified file descriptor with the event loop, arranging
+ * for ready to be set when I/O can be performed on it.
+ * Files that cannot be polled, such as regular files, are always ready.
+ */
+static void
+event_add(int fd, uint32_t events, bool *ready, const char *name)
+{
+	struct epoll_event ev;
+
+	ev.events = events | EPOLLET;
+	ev.data.ptr = ready;
+	*ready = false;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0)
+		return;
+	if (errno != EPERM)
+		err(2, "Error adding %s to the event loop", name);
+	*ready = true;
+}
+
+/* Register all sources and sinks with the event loop. */
+static void
+event_setup(struct source_info *ifiles, struct sink_info *ofiles)
+{
+	struct sink_info *ofp;
+	struct source_info *ifp;
+
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		err(2, "Error creating the event loop");
+	for (ifp = ifiles; ifp; ifp = ifp->next)
+		event_add(ifp->fd, EPOLLIN, &ifp->ready, fp_name(ifp));
+	for (ofp = ofiles; ofp; ofp = ofp->next)
+		event_add(ofp->fd, EPOLLOUT, &ofp->ready, fp_name(ofp));
+	if (page_notify[0] != -1)
+		event_add(page_notify[0], EPOLLIN, &page_ready, "paging notification pipe");
+	event_add(stats_notify[0], EPOLLIN, &stats_ready, "statistics notification pipe");
+}
+
+/*
+ * Set the ready flags of the sources and sinks for which the kernel
+ * reports events.
+ * If block is true, wait until at least one event is reported.
+ */
+static void
+event_wait(struct source_info *ifiles, struct sink_info *ofiles, bool block)
+{
+	struct epoll_event events[64];
+	int i, n;
+
+	if ((n = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(*events),
+	    block ? -1 : 0)) < 0) {
+		/* Interrupted by a signal; its handler notifies through a pipe. */
+		if (errno != EINTR)
+			err(3, "epoll_wait");
+		n = 0;
+	}
+	for (i = 0; i < n; i++)
+		*(bool *)events[i].data.ptr = true;
+}
+#else
+/* The select(2) event loop recalculates readiness on every wait. */
+static void
+event_setup(struct source_info *ifiles, struct sink_info *ofiles)
+{
+}
+
+/*
+ * Set the ready flags of the sources and sinks the event loop waits for,
+ * blocking until at least one of them is ready.
+ */
+static void
+event_wait(struct source_info *ifiles, struct sink_info *ofiles, bool block)
+{
+	fd_set source_fds;
+	fd_set sink_fds;
+	struct sink_info *ofp;
+	struct source_info *ifp;
+	int max_fd = 0;
+
+	FD_ZERO(&source_fds);
+	FD_ZERO(&sink_fds);
+	for (ifp = ifiles; ifp; ifp = ifp->next)
+		if (ifp->wait) {
+			FD_SET(ifp->fd, &source_fds);
+			max_fd = MAX(ifp->fd, max_fd);
+		}
+	for (ofp = ofiles; ofp; ofp = ofp->next)
+		if (ofp->wait) {
+			FD_SET(ofp->fd, &sink_fds);
+			max_fd = MAX(ofp->fd, max_fd);
+		}
+	if (page_jobs) {
+		FD_SET(page_notify[0], &source_fds);
+		max_fd = MAX(page_notify[0], max_fd);
+	}
+	FD_SET(stats_notify[0], &source_fds);
+	max_fd = MAX(stats_notify[0], max_fd);
+	if (select(max_fd + 1, &source_fds, &sink_fds, NULL, NULL) < 0) {
+		/* Interrupted by a signal; its handler notifies through a pipe. */
+		if (errno != EINTR)
+			err(3, "select");
+		FD_ZERO(&source_fds);
+		FD_ZERO(&sink_fds);
+	}
+	page_ready = page_jobs && FD_ISSET(page_notify[0], &source_fds);
+	stats_ready = FD_ISSET(stats_notify[0], &source_fds);
+	for (ifp = ifiles; ifp; ifp = ifp->next)
+		ifp->ready = ifp->wait && FD_ISSET(ifp->fd, &source_fds);
+	for (ofp = ofiles; ofp; ofp = ofp->next) {
+		ofp->ready = ofp->wait && FD_ISSET(ofp->fd, &sink_fds);
+		/* Writes are not attempted, so their blocking is noted here. */
+		if (ofp->wait)
+			sink_blocked(ofp, !ofp->ready);
+	}
+}
+#endif
+
+/* Return the name of the specified state */
+static const char *
+state_name(enum state state)
+{
+	switch (state) {
+	case read_ib:
+		return "read_ib";
+	case read_ob:
+		return "read_ob";
+	case drain_ib:
+		return "drain_ib";
+	case drain_ob:
+		return "drain_ob";
+	case write_ob:
+		return "write_ob";
+	}
+	return "unknown";
+}
+
+static void
+show_state(enum state state)
+{
+	#ifdef DEBUG
+	fprintf(stderr, "State: %s\n", state_name(state));
+	#endif
+}
+
+/* Parse the specified option as a size with a suffix and return its value. */
+static unsigned long
+parse_size(const char *progname, const char *opt)
+{
+	char size;
+	unsigned long n;
+
+	size = 'b';
+	if (sscanf(opt, "%lu%c", &n, &size) < 1)
+		usage(progname);
+	switch (size) {
+	case 'B' : case 'b':
+		return n;
+	case 'K' : case 'k':
+		return n * 1024;
+	case 'M' : case 'm':
+		return n * 1024 * 1024;
+	case 'G' : case 'g':
+		return n * 1024 * 1024 * 1024;
+	default:
+		fprintf(stderr, "Unknown size suffix: %c\n", size);
+		usage(progname);
+	}
+	/* NOTREACHED */
+	return 0;
+}
+
+/*
+ * Detach from the graph's memory budget, returning the memory held.
+ * The last tee to detach marks the segment as removed before
+ * removing it, so that no tee joins it in the meantime.
+ */
+static void
+graph_detach(void)
+{
+	int users;
+
+	graph_release(graph_held);
+	if (graph_user)
+		atomic_store(&graph_user->pid, 0);
+	graph_reclaim();
+	users = atomic_load(&graph_memory->users);
+	while (!atomic_compare_exchange_weak(&graph_memory->users, &users,
+	    users == 1 ? -1 : users - 1))
+		;
+	if (users == 1)
+		(void)shm_unlink(graph_name);
+}
+
+/*
+ * Map the graph's shared memory segment, creating it if needed,
+ * and join the tees sharing it.
+ * Return false if the segment is being removed.
+ */
+static bool
+graph_join(void)
+{
+	void *p;
+	int fd, users;
+
+	if ((fd = shm_open(graph_name, O_RDWR | O_CREAT, 0600)) < 0)
+		err(2, "Error opening the graph's memory budget %s", graph_name);
+	/* A new segment is zero-filled, and thus initialized. */
+	if (ftruncate(fd, sizeof(struct graph_memory)) < 0)
+		err(2, "Error sizing the graph's memory budget %s", graph_name);
+	if ((p = mmap(NULL, sizeof(struct graph_memory), PROT_READ | PROT_WRITE,
+	    MAP_SHARED, fd, 0)) == MAP_FAILED)
+		err(2, "Error mapping the graph's memory budget %s", graph_name);
+	(void)close(fd);
+	graph_memory = (struct graph_memory *)p;
+	users = atomic_load(&graph_memory->users);
+	while (users >= 0 && !atomic_compare_exchange_weak(&graph_memory->users,
+	    &users, users + 1))
+		;
+	if (users >= 0)
+		return true;
+	(void)munmap(p, sizeof(struct graph_memory));
+	graph_memory = NULL;
+	return false;
+}
+
+/*
+ * Share the memory budget specified in the environment with the
+ * other tees of the negotiated graph, through a shared memory
+ * segment that the first of them creates and the last one removes.
+ * Unless a maximum memory size is specified, a tee can then use
+ * all the budget.
+ */
+static void
+graph_setup(const char *progname)
+{
+	const char *budget = getenv("DGSH_MEMORY");
+	long id = dgsh_graph_id();
+	struct graph_user *u;
+	int i, pid;
+
+	if (budget == NULL || id == -1)
+		return;
+	graph_limit = parse_size(progname, budget);
+	snprintf(graph_name, sizeof(graph_name), "/dgsh-memory-%ld-%ld",
+		(long)getuid(), id);
+	for (i = 0; !graph_join(); i++) {
+		/* Take over the removal of a segment whose remover was killed. */
+		if (i == GRAPH_OPEN_TRIES)
+			(void)shm_unlink(graph_name);
+		usleep(1000);
+	}
+
+	for (u = graph_memory->user; u < graph_memory->user + GRAPH_USERS; u++) {
+		pid = 0;
+		if (atomic_compare_exchange_strong(&u->pid, &pid, -1)) {
+			u->start = process_start_time(getpid());
+			atomic_store(&u->held, 0);
+			atomic_store(&u->pid, (int)getpid());
+			graph_user = u;
+			break;
+		}
+	}
+	graph_reclaim();
+	atexit(graph_detach);
+	if (!opt_max_mem)
+		max_mem = graph_limit;
+	DPRINTF(3, "Sharing a %lu byte memory budget through %s", graph_limit, graph_name);
+}
+
+/*
+ * Parse an output delivery policy specification: all, drop,
+ * sample=N, or rate=size, setting the specified policy and its argument.
+ */
+static void
+parse_output_policy(const char *progname, const char *s,
+    enum output_policy *policy, unsigned long *arg)
+{
+	*arg = 0;
+	if (strcmp(s, "all") == 0)
+		*policy = op_all;
+	else if (strcmp(s, "drop") == 0)
+		*policy = op_drop;
+	else if (strncmp(s, "sample=", 7) == 0) {
+		*policy = op_sample;
+		if ((*arg = strtoul(s + 7, NULL, 10)) == 0)
+			usage(progname);
+	} else if (strncmp(s, "rate=", 5) == 0) {
+		*policy = op_rate;
+		if ((*arg = parse_size(progname, s + 5)) == 0)
+			usage(progname);
+	} else
+		usage(progname);
+}
+
+/*
+ * Parse and validate a comma-separated list of integers setting the
+ * variables permute_dest and permute_n.
+ */
+static void
+parse_permute(char *s)
+{
+	char *p;
+	char *copy = strdup(s);
+	int i;
+
+	if (copy == NULL)
+		errx(1, "Out of memory for destination string");
+	DPRINTF(4, "In parse_permute [%s]", s);
+	for (p = strtok(copy, ","); p != NULL; p = strtok(NULL, ","))
+		permute_n++;
+	free(copy);
+	if ((permute_dest = (int *)malloc(sizeof(int) * permute_n)) == NULL)
+		errx(1, "Out of memory for permutation destination");
+	for (p = strtok(s, ","), i= 0; p != NULL; p = strtok(NULL, ","), i++) {
+		permute_dest[i] = atoi(p) - 1;
+		if (permute_dest[i] < 0 || permute_dest[i] >= permute_n)
+			errx(1, "Illegal permutation destination [%s]", s);
+	}
+	for (i = 0; i < permute_n; i++)
+		DPRINTF(4, "%d = %d", i, permute_dest[i]);
+	DPRINTF(4, "permute_n=%d", permute_n);
+}
+
+/*
+ * Parse a merge key specification, which is a field number optionally
+ * followed by a comma and an end field number, with n (numeric) and
+ * r (reverse) modifiers, as in sort(1) -k
+ */
+static void
+parse_sort_key(const char *progname, char *s)
+{
+	struct sort_key *k;
+	char *end;
+
+	sort_keys = (struct sort_key *)realloc(sort_keys,
+		(nsort_keys + 1) * sizeof(struct sort_key));
+	if (sort_keys == NULL)
+		err(1, NULL);
+	k = &sort_keys[nsort_keys++];
+	k->field_begin = (int)strtol(s, &end, 10) - 1;
+	k->field_end = -1;
+	k->numeric = k->reverse = false;
+	if (end == s || k->field_begin < 0)
+		usage(progname);
+	for (; *end; end++)
+		switch (*end) {
+		case 'n':
+			k->numeric = true;
+			break;
+		case 'r':
+			k->reverse = true;
+			break;
+		case ',':
+			s = end + 1;
+			k->field_end = (int)strtol(s, &end, 10) - 1;
+			if (end == s || k->field_end < k->field_begin)
+				usage(progname);
+			end--;
+			break;
+		default:
+			usage(progname);
+		}
+}
+
+/*
+ * Return the input file corresponding to the specified
+ * permuted output file number.
  */
-static struct io_buffer
-sink_buffer(struct sink_info *ofp)
+static struct source_info *
+output_source(struct source_info *ifiles, int output_n)
 {
-	struct io_buffer b;
-	int pool = ofp->pos_written / buffer_size;
-	size_t pool_offset = ofp->pos_written % buffer_size;
-	size_t source_bytes = ofp->pos_to_write - ofp->pos_written;
+	int i, input_n = -1;
+	struct source_info *ifp;
 
-	b.size = MIN(buffer_size - pool_offset, source_bytes);
-	if (b.size == 0)
-		b.p = NULL;
-	else {
-		if (ofp->ifp->bp->page_file_fd != -1)
-			page_in(ofp->ifp->bp, pool);
-		b.p = ofp->ifp->bp->buffers[pool].p + pool_offset;
-	}
-	DPRINTF(4, "Sink buffer(%ld-%ld) returns pool %d(%p) o=%ld l=%ld a=%p for input fd: %s",
-		(long)ofp->pos_written, (long)ofp->pos_to_write, pool, b.size ? ofp->ifp->bp->buffers[pool].p : NULL, (long)pool_offset, (long)b.size, b.p, fp_name(ofp->ifp));
-	return b;
+	/* Find input file number */
+	for (i = 0; i < permute_n; i++)
+		if (permute_dest[i] == output_n) {
+			input_n = i;
+			break;
+		}
+	if (input_n == -1)
+		errx(1, "Unspecified output %d", output_n + 1);
+
+	/* Find input file pointer */
+	for (ifp = ifiles, i = 0; ifp; ifp = ifp->next, i++)
+		if (i == input_n)
+			return ifp;
+	assert(0);
+	return NULL;
 }
 
-/*
- * Return a pointer to read from for writing to a file from a position onward
- */
-static char *
-sink_pointer(struct buffer_pool *bp, off_t pos_written)
+/* Output the allocation and paging counters of the specified buffer pool */
+static void
+buffer_pool_stats(struct buffer_pool *bp)
 {
-	int pool = pos_written / buffer_size;
-	size_t pool_offset = pos_written % buffer_size;
-
-	if (bp->page_file_fd != -1)
-		page_in(bp, pool);
-	return bp->buffers[pool].p + pool_offset;
+	fprintf(stderr, "Buffers allocated: %d Freed: %d Maximum allocated: %d Reused: %d Mapped: %d\n",
+		bp->buffers_allocated, bp->buffers_freed, bp->max_buffers_allocated,
+		bp->buffers_reused, bp->buffers_mapped);
+	fprintf(stderr, "Page out: %d In: %d Pages freed: %d Spilled: %lld Stored: %lld Ratio: %.2f\n",
+		bp->buffers_paged_out, bp->buffers_paged_in, bp->pages_freed,
+		bp->bytes_spilled, bp->bytes_stored,
+		bp->bytes_stored ? (double)bp->bytes_spilled / bp->bytes_stored : 1.0);
 }
 
-/*
- * Return the size of a buffer region that can be read for the specified endpoints
- */
-static size_t
-sink_buffer_length(off_t start, off_t end)
+static void
+memory_stats(struct source_info *ifiles)
 {
-	size_t pool_offset = start % buffer_size;
-	size_t source_bytes = end - start;
+	struct source_info *ifp;
 
-	DPRINTF(4, "sink_buffer_length(%ld, %ld) = %ld",
-		(long)start, (long)end,  (long)MIN(buffer_size - pool_offset, source_bytes));
-	return MIN(buffer_size - pool_offset, source_bytes);
+	for (ifp = ifiles; ifp; ifp = ifp->next) {
+		fprintf(stderr, "Input file: %s\n", fp_name(ifp));
+		buffer_pool_stats(ifp->bp);
+	}
 }
 
+/* Output the pipe capacities and the system calls used for I/O (-P) */
+static void
+io_stats(struct source_info *ifiles, struct sink_info *ofiles)
+{
+	struct source_info *ifp;
+	struct sink_info *ofp;
 
-/* The result of the following read operation. */
-enum read_result {
-	read_ok,	/* Normal read */
-	read_oom,	/* Out of buffer memory */
-	read_again,	/* EAGAIN */
-	read_eof,	/* EOF (0 bytes read) */
-};
+	for (ifp = ifiles; ifp; ifp = ifp->next)
+		fprintf(stderr, "Input file: %s Pipe size: %d Reads: %lld Average: %lld\n",
+			fp_name(ifp), ifp->pipe_size, ifp->reads,
+			ifp->reads ? (long long)ifp->source_pos_read / ifp->reads : 0);
+	for (ofp = ofiles; ofp; ofp = ofp->next)
+		fprintf(stderr, "Output file: %s Pipe size: %d Writes: %lld Average: %lld\n",
+			fp_name(ofp), ofp->pipe_size, ofp->writes,
+			ofp->writes ? (long long)ofp->bytes_written / ofp->writes : 0);
+}
 
-/*
- * Read from the source into the memory buffer
- * Return the number of bytes read, or -1 on end of file.
- */
-static enum read_result
-source_read(struct source_info *ifp)
+/* Ask the event loop to output live statistics */
+static void
+stats_signal(int signo)
 {
-	int n;
-	struct io_buffer b;
+	int saved_errno = errno;
 
-	if (!source_buffer(ifp, &b)) {
-		DPRINTF(4, "Memory full");
-		/* Provide some time for the output to drain. */
-		return read_oom;
-	}
-	if ((n = read(ifp->fd, b.p, b.size)) == -1)
-		switch (errno) {
-		case EAGAIN:
-			DPRINTF(4, "EAGAIN on %s", fp_name(ifp));
-			return read_again;
-		default:
-			err(3, "Read from %s", fp_name(ifp));
-		}
-	ifp->source_pos_read += n;
-	DPRINTF(4, "Read %d out of %zu bytes from %s data=[%.*s]", n, b.size, fp_name(ifp),
-		(int)n * DATA_DUMP, (char *)b.p);
-	/* Return -1 on EOF */
-	return n ? read_ok : read_eof;
+	(void)write(stats_notify[1], "", 1);
+	errno = saved_errno;
+}
+
+/* Arrange for live statistics to be output when receiving SIGUSR1 */
+static void
+stats_setup(void)
+{
+	struct sigaction sa;
+
+	start_time = time_now();
+	if (pipe(stats_notify) < 0)
+		err(2, "Error creating statistics notification pipe");
+	non_block(stats_notify[0], "statistics notification pipe");
+	non_block(stats_notify[1], "statistics notification pipe");
+	sa.sa_handler = stats_signal;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	if (sigaction(SIGUSR1, &sa, NULL) < 0)
+		err(2, "Error setting SIGUSR1 handler");
 }
 
 /*
- * Allocate available read data to empty sinks that can be written to,
- * by adjusting their ifp, pos_written, and pos_to_write pointers.
+ * Output live statistics on the standard error:
+ * the state of the event loop, the data read and the buffer pool of
+ * each source, and the data written, lag behind the data read,
+ * time blocked, and status of each sink.
  */
 static void
-allocate_data_to_sinks(fd_set *sink_fds, struct sink_info *files)
+live_stats(enum state state, struct source_info *ifiles, struct sink_info *ofiles)
 {
+	struct source_info *ifp;
 	struct sink_info *ofp;
-	int available_sinks = 0;
-	off_t pos_assigned = 0;
-	size_t available_data, data_per_sink;
-	size_t data_to_assign = 0;
-	bool use_reliable = false;
-
-	/* Easy case: distribute to all files. */
-	if (!opt_scatter) {
-		for (ofp = files; ofp; ofp = ofp->next) {
-			/* Advance to next input file, if required */
-			if (ofp->pos_written == ofp->ifp->source_pos_read &&
-			    ofp->ifp->reached_eof &&
-			    !ofp->ifp->chain_last) {
-				DPRINTF(4, "%s(): advance to input file %s\n",
-						__func__, fp_name(ofp->ifp));
-				ofp->ifp = ofp->ifp->next;
-				ofp->ifp->active = true;
-				ofp->pos_written = 0;
-			}
-			ofp->pos_to_write = ofp->ifp->source_pos_read;
-		}
-		return;
-	}
+	char drain[64];
+	double now = time_now();
 
-	/*
-	 * Difficult case: fair scattering across available sinks
-	 * Thankfully here we only have a single input file
-	 */
+	while (read(stats_notify[0], drain, sizeof(drain)) > 0)
+		;
+	stats_ready = false;
 
-	/* Determine amount of fresh data to write and number of available sinks. */
-	for (ofp = files; ofp; ofp = ofp->next) {
-		pos_assigned = MAX(pos_assigned, ofp->pos_to_write);
-		if (ofp->pos_written == ofp->pos_to_write && FD_ISSET(ofp->fd, sink_fds))
-			available_sinks++;
+	fprintf(stderr, "Time: %.3f State: %s\n", now - start_time,
+		state_name(state));
+	for (ifp = ifiles; ifp; ifp = ifp->next) {
+		struct buffer_pool *bp = ifp->bp;
+		int i, in_memory = 0, in_file = 0, in_transit = 0;
+
+		for (i = bp->free_pool_begin; i < bp->allocated_pool_end; i++)
+			switch (bp->buffers[i].s) {
+			case s_memory:
+			case s_memory_backed:
+			case s_mapped:
+				in_memory++;
+				break;
+			case s_file:
+				in_file++;
+				break;
+			case s_paging_out:
+			case s_paging_in:
+				in_transit++;
+				break;
+			case s_none:
+				break;
+			}
+		fprintf(stderr, "Input file: %s Read: %ld%s\n", fp_name(ifp),
+			(long)ifp->source_pos_read,
+			ifp->reached_eof ? " EOF" : "");
+		fprintf(stderr, "Buffers in memory: %d In file: %d Being paged: %d\n",
+			in_memory, in_file, in_transit);
+		buffer_pool_stats(bp);
 	}
-
-	/*
-	 * Ensure we operate in a continuous memory region by clamping
-	 * the length of the available data to terminate at the end of
-	 * the buffer.
-	 */
-	available_data = sink_buffer_length(pos_assigned, files->ifp->source_pos_read);
-
-	if (available_sinks == 0)
-		return;
-
-	/* Assign data to sinks. */
-	data_per_sink = available_data / available_sinks;
-	for (ofp = files; ofp; ofp = ofp->next) {
-		/* Move to next file if this has data to write, or isn't ready. */
-		if (ofp->pos_written != ofp->pos_to_write || !FD_ISSET(ofp->fd, sink_fds))
-			continue;
-
-		DPRINTF(4, "pos_assigned=%ld source_pos_read=%ld available_data=%ld available_sinks=%d data_per_sink=%ld",
-			(long)pos_assigned, (long)ofp->ifp->source_pos_read, (long)available_data, available_sinks, (long)data_per_sink);
-		/* First file also gets the remainder bytes. */
-		if (data_to_assign == 0)
-			data_to_assign = sink_buffer_length(pos_assigned,
-				pos_assigned + data_per_sink + available_data % available_sinks);
+	for (ofp = ofiles; ofp; ofp = ofp->next) {
+		const char *status;
+		off_t lag;
+
+		if (!ofp->active)
+			status = "closed";
+		else if (ofp->blocked_since != 0)
+			status = "blocked";
+		else if (sink_pending(ofp))
+			status = "writing";
 		else
-			data_to_assign = data_per_sink;
-		/*
-		 * Assign data_to_assign to *ofp (pos_written, pos_to_write),
-		 * and advance pos_assigned.
-		 */
-		ofp->pos_written = pos_assigned;		/* Initially nothing has been written. */
-		if (block_len == 0) {			/* Write whole lines */
-			if (available_data > buffer_size / 2 && !use_reliable) {
-				/*
-				 * Efficient algorithm:
-				 * Assume that multiple lines appear in data_per_sink.
-				 * Go to a calculated boundary and scan backward to find
-				 * a new line.
-				 */
-				off_t data_end = pos_assigned + data_to_assign - 1;
-
-				for (;;) {
-					if (data_end <= pos_assigned) {
-						/*
-						 * If no newline was found with backward scanning
-						 * degenerate to the efficient algorithm. This will
-						 * scan further forward, and can defer writing the
-						 * last chunk, until more data is read.
-						 */
-						use_reliable = true;
-						goto reliable;
-					}
-					if (*sink_pointer(ofp->ifp->bp, data_end) == rt) {
-						pos_assigned = data_end + 1;
-						break;
-					}
-					data_end--;
-				}
-			} else {
-				/*
-				 * Reliable algorithm:
-				 * Scan forward for new lines until at least
-				 * data_per_sink are covered, or we reach the end of available data.
-				 * Keep a record of the last encountered newline.
-				 * This is used to backtrack when we scan past the end of the
-				 * available data.
-				 */
-				off_t data_end, last_nl;
-
-			reliable:
-				last_nl = -1;
-				data_end = pos_assigned;
-				for (;;) {
-					if (data_end >= ofp->ifp->source_pos_read) {
-						if (last_nl != -1) {
-							pos_assigned = last_nl + 1;
-							break;
-						} else {
-							/* No newline found in buffer; defer writing. */
-							ofp->pos_to_write = pos_assigned;
-							DPRINTF(4, "scatter to file[%s] no newline from %ld to %ld",
-								fp_name(ofp), (long)pos_assigned, (long)data_end);
-							return;
-						}
-					}
-
-					if (*sink_pointer(ofp->ifp->bp, data_end) == rt) {
-						last_nl = data_end;
-						if (data_end - pos_assigned > data_per_sink) {
-							pos_assigned = data_end + 1;
-							break;
-						}
-					}
-					data_end++;
-				}
-			}
-		} else
-			pos_assigned += data_to_assign;
-		ofp->pos_to_write = pos_assigned;
-		DPRINTF(4, "scatter to file[%s] pos_written=%ld pos_to_write=%ld data=[%.*s]",
-			fp_name(ofp), (long)ofp->pos_written, (long)ofp->pos_to_write,
-			(int)(ofp->pos_to_write - ofp->pos_written) * DATA_DUMP, sink_pointer(ofp->ifp->bp, ofp->pos_written));
+			status = "idle";
+		/* A split sink lags only behind the end of its part. */
+		lag = (scatter_policy == sp_split ? ofp->pos_to_write :
+			ofp->ifp->source_pos_read) - ofp->pos_written;
+		fprintf(stderr, "Output file: %s Written: %ld Lag: %ld Blocked: %.3f Status: %s",
+			fp_name(ofp), (long)ofp->bytes_written, (long)lag,
+			ofp->time_blocked + (ofp->blocked_since != 0 ?
+			now - ofp->blocked_since : 0),
+			status);
+		if (ofp->policy != op_all)
+			fprintf(stderr, " Dropped: %ld", (long)ofp->bytes_dropped);
+		fputc('\n', stderr);
 	}
 }
 
-
 /*
- * Write out from the memory buffer to the sinks where write will not block.
- * Free memory no more needed even by the write pointer farthest behind.
- * Return the number of bytes written.
+ * Divide a mapped source among the sinks into contiguous parts
+ * of about equal size, which end at a record or block boundary,
+ * setting each sink's range of the source's data to write.
+ * The record boundaries are found by scanning forward from the
+ * cut points.
+ * Return false if the data cannot be divided in this way.
  */
-static size_t
-sink_write(struct source_info *ifiles, fd_set *sink_fds, struct sink_info *ofiles)
+static bool
+split_setup(struct source_info *ifiles, struct sink_info *ofiles)
 {
 	struct sink_info *ofp;
-	struct source_info *ifp;
-	size_t written = 0;
+	size_t size = ifiles->map_size, pos = 0, cut;
+	char *p;
+	int i = 0, n = 0;
 
-	for (ifp = ifiles; ifp; ifp = ifp->next) {
-		ifp->read_min_pos = ifp->source_pos_read;
-		ifp->is_read = false;
+	if (gather_mode != gm_concatenate || ifiles->next || ifiles->map == NULL)
+		return false;
+	for (ofp = ofiles; ofp; ofp = ofp->next)
+		n++;
+	for (ofp = ofiles; ofp; ofp = ofp->next) {
+		i++;
+		cut = MAX(size / n * i + size % n * i / n, pos);
+		if (ofp->next == NULL)
+			cut = size;
+		else if (block_len)
+			cut = MIN((cut + block_len - 1) / block_len * block_len, size);
+		else if (cut > 0 && cut < size) {
+			/* End the part with the record that contains the cut. */
+			p = memchr(ifiles->map + cut - 1, rt, size - cut + 1);
+			cut = p ? (size_t)(p - ifiles->map) + 1 : size;
+		}
+		ofp->ifp = ifiles;
+		ofp->pos_written = pos;
+		ofp->pos_to_write = pos = cut;
+#ifdef __linux__
+		/* Pipes are fed from the file with sendfile(2). */
+		if (ofp->file_copy == fc_none)
+			ofp->file_copy = fc_sendfile;
+#endif
+		DPRINTF(3, "Split %s range %zu-%zu to %s", fp_name(ifiles),
+			(size_t)ofp->pos_written, cut, fp_name(ofp));
 	}
+	/* The whole source is available through its mapping. */
+	ifiles->source_pos_read = size;
+	ifiles->reached_eof = true;
+	source_map_seek(ifiles);
+	return true;
+}
 
-	allocate_data_to_sinks(sink_fds, ofiles);
-	for (ofp = ofiles; ofp; ofp = ofp->next) {
-		DPRINTF(4, "\n%s(): try write to file %s", __func__, fp_name(ofp));
-		if (ofp->active && FD_ISSET(ofp->fd, sink_fds)) {
-			int n;
-			struct io_buffer b;
-
-			b = sink_buffer(ofp);
-			DPRINTF(4, "\n%s(): sink buffer returned %d bytes to write",
-					__func__, (int)b.size);
-			if (b.size == 0)
-				/* Can happen when a line spans a buffer */
-				n = 0;
-			else {
-				n = write(ofp->fd, b.p, b.size);
+/*
+ * Write to the sinks their parts of the source divided by split_setup,
+ * copying them from its file within the kernel where possible.
+ * Each sink is written when it can accept data, so that a slow
+ * sink's reader does not delay the others.
+ */
+static void
+split_run(struct source_info *ifp, struct sink_info *ofiles)
+{
+	struct sink_info *ofp;
+	bool pending;
+
+	for (;;) {
+		pending = false;
+		for (ofp = ofiles; ofp; ofp = ofp->next) {
+			ofp->wait = ofp->active && ofp->pos_written < ofp->pos_to_write;
+			while (fp_ready(ofp)) {
+				struct iovec iov;
+				ssize_t n;
+
+				iov.iov_base = ifp->map + ofp->pos_written;
+				iov.iov_len = MIN(ofp->pos_to_write - ofp->pos_written,
+					buffer_size);
+				n = sink_transfer(ofp, ifp, ofp->pos_written, &iov, 1);
+				ofp->writes++;
 				if (n < 0)
 					switch (errno) {
 					/* EPIPE is acceptable, for the sink's reader can terminate early. */
@@ -795,229 +4408,483 @@ sink_write(struct source_info *ifiles, fd_set *sink_fds, struct sink_info *ofile
 						break;
 					case EAGAIN:
 						DPRINTF(4, "EAGAIN for %s", fp_name(ofp));
-						n = 0;
+						ofp->ready = false;
+						sink_blocked(ofp, true);
 						break;
 					default:
 						err(2, "Error writing to %s", fp_name(ofp));
 					}
 				else {
-					ofp->pos_written += n;
-					written += n;
+					sink_blocked(ofp, false);
+					sink_written(ofp, n);
 				}
+				ofp->wait = ofp->active && ofp->pos_written < ofp->pos_to_write;
+			}
+			if (ofp->wait)
+				pending = true;
+			else if (ofp->active) {
+				(void)close(ofp->fd);
+				ofp->active = false;
 			}
-			DPRINTF(4, "Wrote %d out of %zu bytes for file %s pos_written=%lu data=[%.*s]",
-				n, b.size, fp_name(ofp), (unsigned long)ofp->pos_written, (int)n * DATA_DUMP, (char *)b.p);
-		}
-		if (ofp->active) {
-			ofp->ifp->read_min_pos = MIN(ofp->ifp->read_min_pos, ofp->pos_written);
-			ofp->ifp->is_read = true;
 		}
+		if (!pending)
+			return;
+		event_wait(NULL, ofiles, true);
+		if (stats_ready)
+			live_stats(write_ob, ifp, ofiles);
 	}
+}
 
-	/* Free buffers all sinks have read */
-	for (ifp = ifiles; ifp; ifp = ifp->next) {
-		memory_free(ifp->bp, ifp->read_min_pos);
-		/*
-		 * We are reading this source, so don't even think freeing
-		 * sources after this.
-		 */
-		if (ifp->is_read)
-			break;
-	}
+/*
+ * Threaded engine (-j)
+ * The main thread reads the sources into the buffer pools, while
+ * writer threads each write to a group of sinks, so that reading
+ * overlaps with writing, and writing to a slow sink does not delay
+ * writing to the others.
+ * The buffer pools, the positions of sources and sinks, and the
+ * allocation of data to sinks are protected by engine_mutex, which is
+ * released only around read(2), writev(2), and poll(2).
+ * Data referenced by an I/O vector remain valid while the mutex is
+ * released, because buffers are freed only below the minimum position
+ * written by the sinks reading them.
+ * Each writer thread publishes for each source the minimum position
+ * written by its sinks, so that finding the buffers to free takes time
+ * proportional to the number of writer threads rather than sinks.
+ */
+struct writer {
+	pthread_t thread;
+	int id;			/* Index in the sources' writer_min */
+	struct sink_info **sinks;	/* Sinks written by the thread */
+	int nsinks;		/* Number of sinks */
+	int wake[2];		/* Pipe through which the thread is woken */
+	bool idle;		/* True while waiting in poll(2) */
+};
 
-	DPRINTF(4, "Wrote %zu total bytes", written);
-	return written;
-}
+static struct writer *writers;
+static int nwriters;
+static struct source_info *engine_ifiles;
+static struct sink_info *engine_ofiles;
+static pthread_mutex_t engine_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Signalled when a writer thread writes data, counted in engine_writes */
+static pthread_cond_t engine_written = PTHREAD_COND_INITIALIZER;
+static unsigned long engine_writes;
 
 static void
-usage(const char *name)
+engine_lock(void)
 {
-	fprintf(stderr, "Usage %s [-b size] [-i file] [-IMs] [-o file] [-m size] [-t char]\n"
-		"-a"		"\tOpen output file(s) for appending\n"
-		"-b size"	"\tSpecify the size of the buffer to use (used for stress testing)\n"
-		"-f"		"\tOverflow buffered data into a temporary file\n"
-		"-I"		"\tInput-side buffering\n"
-		"-i file"	"\tGather input from specified file\n"
-		"-m size[k|M|G]""\tSpecify the maximum buffer memory size\n"
-		"-M"		"\tProvide memory use statistics on termination\n"
-		"-o file"	"\tScatter output to specified file\n"
-		"-p d1[,d2...]"	"\tPermute inputs to specified outputs\n"
-		"-s"		"\tScatter the input across the files, rather than copying it to all\n"
-		"-T dir"	"\tSpecify directory for storing temporary file\n"
-		"-t char"	"\tProcess char-terminated records (newline default)\n",
-		name);
-	exit(1);
+	int e;
+
+	if ((e = pthread_mutex_lock(&engine_mutex)) != 0) {
+		errno = e;
+		err(2, "Error locking engine mutex");
+	}
 }
 
-/*
- * Set the specified file descriptor to operate in non-blocking
- * mode.
- * It seems that even if select returns for a specified file
- * descriptor, performing I/O to it may block depending on the
- * amount of data specified.
- * See See http://pubs.opengroup.org/onlinepubs/009695399/functions/write.html#tag_03_866
- */
 static void
-non_block(int fd, const char *name)
-{
-	int flags = fcntl(fd, F_GETFL, 0);
-	if (flags < 0)
-		err(2, "Error getting flags for %s", name);
-	if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
-		err(2, "Error setting %s to non-blocking mode", name);
+engine_unlock(void)
+{
+	int e;
+
+	if ((e = pthread_mutex_unlock(&engine_mutex)) != 0) {
+		errno = e;
+		err(2, "Error unlocking engine mutex");
+	}
 }
 
-/*
- * Show the arguments passed to select(2) in human-readable form
- * If check is true, abort the program if no bit is on
- */
+/* Publish the minimum position written by the active sinks of a writer */
 static void
-show_select_args(const char *msg, fd_set *source_fds, struct source_info *ifiles, fd_set *sink_fds, struct sink_info *ofiles, bool check)
+writer_min_update(struct writer *wp)
 {
-	#ifdef DEBUG
-	struct sink_info *ofp;
 	struct source_info *ifp;
-	int nbits = 0;
+	int i;
 
-	fprintf(stderr, "%s: ", msg);
-	for (ifp = ifiles; ifp; ifp = ifp->next)
-		if (FD_ISSET(ifp->fd, source_fds)) {
-			fprintf(stderr, "%s ", fp_name(ifp));
-			nbits++;
-		}
-	for (ofp = ofiles; ofp; ofp = ofp->next)
-		if (FD_ISSET(ofp->fd, sink_fds)) {
-			fprintf(stderr, "%s ", fp_name(ofp));
-			nbits++;
-		}
-	fputc('\n', stderr);
-	if (check && nbits == 0)
-		abort();
-	#endif
+	for (ifp = engine_ifiles; ifp; ifp = ifp->next)
+		ifp->writer_min[wp->id] = -1;
+	for (i = 0; i < wp->nsinks; i++) {
+		struct sink_info *ofp = wp->sinks[i];
+		off_t *min = &ofp->ifp->writer_min[wp->id];
+
+		if (ofp->active && (*min == -1 || ofp->pos_written < *min))
+			*min = ofp->pos_written;
+	}
 }
 
+/*
+ * Free buffers all sinks have written, following the source order
+ * used by sink_write().
+ */
 static void
-show_state(enum state state)
+engine_free(void)
 {
-	#ifdef DEBUG
-	char *s;
+	struct source_info *ifp;
+	bool chain_read = false;
+	int i;
 
-	switch (state) {
-	case read_ib:
-		s = "read_ib";
-		break;
-	case read_ob:
-		s = "read_ob";
-		break;
-	case drain_ib:
-		s = "drain_ib";
-		break;
-	case drain_ob:
-		s = "drain_ob";
-		break;
-	case write_ob:
-		s = "write_ob";
-		break;
+	for (ifp = engine_ifiles; ifp; ifp = ifp->next) {
+		off_t min_pos = ifp->source_pos_read;
+		bool is_read = false;
+
+		for (i = 0; i < nwriters; i++)
+			if (ifp->writer_min[i] != -1) {
+				min_pos = MIN(min_pos, ifp->writer_min[i]);
+				is_read = true;
+			}
+		if (!chain_read)
+			memory_free(ifp->bp, min_pos);
+		/* Sources chained after one being read are not yet read. */
+		if (is_read)
+			chain_read = true;
+		if (ifp->chain_last)
+			chain_read = false;
 	}
-	fprintf(stderr, "State: %s\n", s);
-	#endif
 }
 
-/* Parse the specified option as a size with a suffix and return its value. */
-static unsigned long
-parse_size(const char *progname, const char *opt)
+/* Return true if the writer has data it can write without blocking */
+static bool
+writer_has_work(struct writer *wp)
 {
-	char size;
-	unsigned long n;
+	int i;
 
-	size = 'b';
-	if (sscanf(opt, "%lu%c", &n, &size) < 1)
-		usage(progname);
-	switch (size) {
-	case 'B' : case 'b':
-		return n;
-	case 'K' : case 'k':
-		return n * 1024;
-	case 'M' : case 'm':
-		return n * 1024 * 1024;
-	case 'G' : case 'g':
-		return n * 1024 * 1024 * 1024;
-	default:
-		fprintf(stderr, "Unknown size suffix: %c\n", size);
-		usage(progname);
+	for (i = 0; i < wp->nsinks; i++) {
+		struct sink_info *ofp = wp->sinks[i];
+
+		if (ofp->active && ofp->ready &&
+		    ofp->pos_written < ofp->pos_to_write)
+			return true;
 	}
-	/* NOTREACHED */
-	return 0;
+	return false;
 }
 
 /*
- * Parse and validate a comma-separated list of integers setting the
- * variables permute_dest and permute_n.
+ * Allocate available data to the sinks, publish the resulting
+ * positions, and wake idle writer threads that have data to write,
+ * or need to retire their sinks.
  */
 static void
-parse_permute(char *s)
+engine_allocate(void)
 {
-	char *p;
-	char *copy = strdup(s);
 	int i;
 
-	if (copy == NULL)
-		errx(1, "Out of memory for destination string");
-	DPRINTF(4, "In parse_permute [%s]", s);
-	for (p = strtok(copy, ","); p != NULL; p = strtok(NULL, ","))
-		permute_n++;
-	free(copy);
-	if ((permute_dest = (int *)malloc(sizeof(int) * permute_n)) == NULL)
-		errx(1, "Out of memory for permutation destination");
-	for (p = strtok(s, ","), i= 0; p != NULL; p = strtok(NULL, ","), i++) {
-		permute_dest[i] = atoi(p) - 1;
-		if (permute_dest[i] < 0 || permute_dest[i] >= permute_n)
-			errx(1, "Illegal permutation destination [%s]", s);
+	allocate_data_to_sinks(engine_ofiles);
+	for (i = 0; i < nwriters; i++) {
+		struct writer *wp = &writers[i];
+
+		writer_min_update(wp);
+		if (wp->idle && (reached_eof || writer_has_work(wp))) {
+			wp->idle = false;
+			if (write(wp->wake[1], "", 1) < 0 && errno != EAGAIN)
+				err(2, "Error waking writer thread");
+		}
 	}
-	for (i = 0; i < permute_n; i++)
-		DPRINTF(4, "%d = %d", i, permute_dest[i]);
-	DPRINTF(4, "permute_n=%d", permute_n);
 }
 
-/*
- * Return the input file corresponding to the specified
- * permuted output file number.
- */
-static struct source_info *
-output_source(struct source_info *ifiles, int output_n)
+/* Return true if all the data read have been allocated to the sinks */
+static bool
+engine_allocated(void)
 {
-	int i, input_n = -1;
-	struct source_info *ifp;
+	struct sink_info *ofp;
 
-	/* Find input file number */
-	for (i = 0; i < permute_n; i++)
-		if (permute_dest[i] == output_n) {
-			input_n = i;
+	if (!opt_scatter)
+		return true;
+	if (scatter_ifp == NULL || !scatter_ifp->chain_last)
+		return false;
+	for (ofp = engine_ofiles; ofp; ofp = ofp->next)
+		if (ofp->ifp == scatter_ifp &&
+		    ofp->pos_to_write == scatter_ifp->source_pos_read)
+			return true;
+	return false;
+}
+
+/* Write to a writer thread's sinks until all have been retired */
+static void *
+writer_thread(void *arg)
+{
+	struct writer *wp = (struct writer *)arg;
+	struct sink_info **polled;
+	struct pollfd *pfd;
+	struct job {
+		struct sink_info *ofp;
+		struct source_info *copy_ifp;	/* Mapped source to copy from */
+		off_t pos;			/* Position of the data */
+		struct iovec iov[IOV_MAX];
+		int iovcnt;
+		ssize_t n;
+		int error;
+	} *jobs;
+	char drain[64];
+	int i;
+
+	pfd = (struct pollfd *)malloc((wp->nsinks + 1) * sizeof(struct pollfd));
+	polled = (struct sink_info **)malloc(wp->nsinks * sizeof(struct sink_info *));
+	jobs = (struct job *)malloc(wp->nsinks * sizeof(struct job));
+	if (pfd == NULL || polled == NULL || jobs == NULL)
+		err(1, NULL);
+
+	engine_lock();
+	for (;;) {
+		int njobs = 0, npoll = 0, nactive = 0;
+
+		engine_allocate();
+		for (i = 0; i < wp->nsinks; i++) {
+			struct sink_info *ofp = wp->sinks[i];
+
+			if (!ofp->active)
+				continue;
+			if (ofp->pos_written == ofp->pos_to_write) {
+				if (reached_eof && engine_allocated()) {
+					DPRINTF(3, "Retiring file %s pos_written=pos_to_write=%ld",
+						fp_name(ofp), (long)ofp->pos_written);
+					/* No more data to write; close fd to avoid deadlocks downstream. */
+					if (close(ofp->fd) == -1)
+						err(2, "Error closing %s", fp_name(ofp));
+					ofp->active = ofp->wait = false;
+					continue;
+				}
+				/* Scattered data are allocated only to sinks that are ready. */
+				if (opt_scatter && !ofp->ready)
+					polled[npoll++] = ofp;
+			} else if (ofp->ready) {
+				jobs[njobs].ofp = ofp;
+				jobs[njobs].copy_ifp = sink_copy_source(ofp);
+				jobs[njobs].pos = ofp->pos_written;
+				jobs[njobs].iovcnt = sink_iovec(ofp, jobs[njobs].iov);
+				njobs++;
+			} else
+				polled[npoll++] = ofp;
+			nactive++;
+		}
+		if (nactive == 0)
 			break;
+
+		if (njobs) {
+			engine_unlock();
+			for (i = 0; i < njobs; i++) {
+				jobs[i].n = sink_transfer(jobs[i].ofp, jobs[i].copy_ifp,
+					jobs[i].pos, jobs[i].iov, jobs[i].iovcnt);
+				jobs[i].ofp->writes++;
+				jobs[i].error = errno;
+			}
+			engine_lock();
+			for (i = 0; i < njobs; i++) {
+				struct sink_info *ofp = jobs[i].ofp;
+
+				if (jobs[i].n < 0)
+					switch (jobs[i].error) {
+					/* EPIPE is acceptable, for the sink's reader can terminate early. */
+					case EPIPE:
+						ofp->active = ofp->wait = false;
+						(void)close(ofp->fd);
+						DPRINTF(4, "EPIPE for %s", fp_name(ofp));
+						break;
+					case EAGAIN:
+						DPRINTF(4, "EAGAIN for %s", fp_name(ofp));
+						ofp->ready = false;
+						sink_blocked(ofp, true);
+						break;
+					default:
+						errno = jobs[i].error;
+						err(2, "Error writing to %s", fp_name(ofp));
+					}
+				else {
+					sink_blocked(ofp, false);
+					sink_written(ofp, jobs[i].n);
+				}
+			}
+			writer_min_update(wp);
+			engine_writes++;
+			pthread_cond_signal(&engine_written);
+			continue;
 		}
-	if (input_n == -1)
-		errx(1, "Unspecified output %d", output_n + 1);
 
-	/* Find input file pointer */
-	for (ifp = ifiles, i = 0; ifp; ifp = ifp->next, i++)
-		if (i == input_n)
-			return ifp;
-	assert(0);
+		/* Wait until a sink can be written or more data become available. */
+		for (i = 0; i < npoll; i++) {
+			pfd[i].fd = polled[i]->fd;
+			pfd[i].events = POLLOUT;
+		}
+		pfd[npoll].fd = wp->wake[0];
+		pfd[npoll].events = POLLIN;
+		wp->idle = true;
+		engine_unlock();
+		if (poll(pfd, npoll + 1, -1) < 0 && errno != EINTR)
+			err(2, "poll");
+		while (read(wp->wake[0], drain, sizeof(drain)) > 0)
+			;
+		engine_lock();
+		wp->idle = false;
+		for (i = 0; i < npoll; i++)
+			if (pfd[i].revents)
+				polled[i]->ready = true;
+	}
+	writer_min_update(wp);
+	engine_writes++;
+	pthread_cond_signal(&engine_written);
+	engine_unlock();
+	free(jobs);
+	free(polled);
+	free(pfd);
 	return NULL;
 }
 
+/* Assign the sinks to writer threads and start them */
 static void
-memory_stats(struct source_info *ifiles)
+engine_setup(struct source_info *ifiles, struct sink_info *ofiles)
 {
 	struct source_info *ifp;
+	struct sink_info *ofp;
+	int i, e, nsinks = 0;
+
+	engine_ifiles = ifiles;
+	engine_ofiles = ofiles;
+	for (ofp = ofiles; ofp; ofp = ofp->next)
+		nsinks++;
+	nwriters = MIN(opt_writers, nsinks);
+	assert(nwriters > 0);
+	if ((writers = (struct writer *)calloc(nwriters, sizeof(struct writer))) == NULL)
+		err(1, NULL);
+	for (i = 0; i < nwriters; i++) {
+		writers[i].id = i;
+		writers[i].sinks = (struct sink_info **)malloc(nsinks * sizeof(struct sink_info *));
+		if (writers[i].sinks == NULL)
+			err(1, NULL);
+		if (pipe(writers[i].wake) < 0)
+			err(2, "Error creating writer thread wake-up pipe");
+		non_block(writers[i].wake[0], "writer thread wake-up pipe");
+		non_block(writers[i].wake[1], "writer thread wake-up pipe");
+	}
+
+	/* Distribute the sinks round-robin; optimistically try I/O before polling. */
+	for (ofp = ofiles, i = 0; ofp; ofp = ofp->next, i++) {
+		struct writer *wp = &writers[i % nwriters];
 
+		ofp->writer = wp->id;
+		wp->sinks[wp->nsinks++] = ofp;
+		ofp->wait = ofp->ready = true;
+	}
 	for (ifp = ifiles; ifp; ifp = ifp->next) {
-		fprintf(stderr, "Input file: %s\n", fp_name(ifp));
-		fprintf(stderr, "Buffers allocated: %d Freed: %d Maximum allocated: %d\n",
-			ifp->bp->buffers_allocated, ifp->bp->buffers_freed, ifp->bp->max_buffers_allocated);
-		fprintf(stderr, "Page out: %d In: %d Pages freed: %d\n",
-			ifp->bp->buffers_paged_out, ifp->bp->buffers_paged_in, ifp->bp->pages_freed);
+		if ((ifp->writer_min = (off_t *)malloc(nwriters * sizeof(off_t))) == NULL)
+			err(1, NULL);
+		ifp->wait = ifp->ready = true;
+	}
+	for (i = 0; i < nwriters; i++)
+		writer_min_update(&writers[i]);
+
+	for (i = 0; i < nwriters; i++)
+		if ((e = pthread_create(&writers[i].thread, NULL, writer_thread,
+		    &writers[i])) != 0) {
+			errno = e;
+			err(2, "Error creating writer thread");
+		}
+}
+
+/*
+ * Read from the sources, according to the specified input- or
+ * output-side buffering state, until all reach EOF,
+ * and wait for the writer threads to finish.
+ */
+static void
+engine_run(enum state state)
+{
+	struct source_info *ifp;
+	struct source_info **polled;
+	struct pollfd *pfd;
+	unsigned long writes;
+	int i, nsources = 0;
+
+	for (ifp = engine_ifiles; ifp; ifp = ifp->next)
+		nsources++;
+	pfd = (struct pollfd *)malloc((nsources + 1) * sizeof(struct pollfd));
+	polled = (struct source_info **)malloc(nsources * sizeof(struct source_info *));
+	if (pfd == NULL || polled == NULL)
+		err(1, NULL);
+
+	engine_lock();
+	for (;;) {
+		bool eof = true, progress = false;
+		int npoll = 0;
+
+		for (ifp = engine_ifiles; ifp; ifp = ifp->next) {
+			struct iovec iov[IOV_MAX];
+			int iovcnt;
+			ssize_t n;
+
+			if (ifp->reached_eof)
+				continue;
+			eof = false;
+			if (state == read_ob && !ifp->active)
+				continue;
+			if (!ifp->ready) {
+				polled[npoll++] = ifp;
+				continue;
+			}
+			engine_free();
+			if (ifp->map != NULL)
+				n = source_map_read(ifp);
+			else if ((iovcnt = source_iovec(ifp, iov)) == 0) {
+				/* Cannot fullfill promise to never block source, so bail out. */
+				if (state == read_ib)
+					errx(1, "Out of memory with input-side buffering specified");
+				/* Allow buffers to empty. */
+				DPRINTF(4, "Memory full");
+				writes = engine_writes;
+				while (engine_writes == writes)
+					pthread_cond_wait(&engine_written, &engine_mutex);
+				progress = true;
+				continue;
+			} else {
+				engine_unlock();
+				n = readv(ifp->fd, iov, iovcnt);
+				engine_lock();
+				source_read_done(ifp, n);
+				if (n < 0) {
+					if (errno != EAGAIN)
+						err(3, "Read from %s", fp_name(ifp));
+					ifp->ready = false;
+					polled[npoll++] = ifp;
+					continue;
+				}
+			}
+			if (n == 0) {
+				ifp->reached_eof = true;
+				if (state == read_ob) {
+					ifp->active = false;
+					if (!ifp->chain_last)
+						ifp->next->active = true;
+				}
+			}
+			engine_allocate();
+			progress = true;
+		}
+		if (eof)
+			break;
+		if (progress)
+			continue;
+
+		/* Wait until a source can be read. */
+		for (i = 0; i < npoll; i++) {
+			pfd[i].fd = polled[i]->fd;
+			pfd[i].events = POLLIN;
+		}
+		pfd[npoll].fd = stats_notify[0];
+		pfd[npoll].events = POLLIN;
+		engine_unlock();
+		if (poll(pfd, npoll + 1, -1) < 0 && errno != EINTR)
+			err(2, "poll");
+		engine_lock();
+		for (i = 0; i < npoll; i++)
+			if (pfd[i].revents)
+				polled[i]->ready = true;
+		if (pfd[npoll].revents)
+			live_stats(state, engine_ifiles, engine_ofiles);
 	}
+	reached_eof = true;
+	engine_allocate();
+	engine_unlock();
+
+	for (i = 0; i < nwriters; i++)
+		pthread_join(writers[i].thread, NULL);
+	free(polled);
+	free(pfd);
 }
 
 /*
@@ -1120,6 +4987,11 @@ list_transpose(struct list *lst, int row_length)
  * C->F->I	>	c
  * Input files are chained into groups
  *
+ * Scatter from many to many
+ * A->B->C	>	a b c d
+ * All input files are chained together and
+ * all output files read from the chain
+ *
  * Note that cat, tee, and perm are special cases of the multipipe ones
  * are are implemented as such.
  */
@@ -1136,7 +5008,16 @@ chain_io_files(struct source_info *ifiles, struct sink_info *ofiles, bool permut
 	for (ofp = ofiles; ofp; ofp = ofp->next)
 		nout++;
 
-	if (nin >= nout) {
+	if (opt_scatter) {
+		for (ifp = ifiles; ifp; ifp = ifp->next) {
+			ifp->active = (ifp == ifiles);
+			ifp->chain_last = (ifp->next == NULL);
+		}
+		for (ofp = ofiles; ofp; ofp = ofp->next) {
+			ofp->ifp = ifiles;
+			ofp->chain_last = true;
+		}
+	} else if (nin >= nout) {
 		/*
 		 * Read from many output to few.
 		 * First input element in group is active.
@@ -1194,19 +5075,26 @@ chain_io_files(struct source_info *ifiles, struct sink_info *ofiles, bool permut
 int
 main(int argc, char *argv[])
 {
-	int max_fd = 0;
 	struct sink_info *ofiles = NULL, *ofp;
 	struct sink_info **oend = &ofiles;
 	struct source_info *ifiles = NULL, *ifp;
 	struct source_info **iend = &ifiles;
 	struct source_info *front_ifp;	/* To keep output sequential, never output past this one */
+	struct source_info *write_ifiles;	/* Sources the sinks write data from */
 	int ch;
 	const char *progname = argv[0];
 	enum state state = read_ob;
 	bool opt_memory_stats = false;
+	bool opt_process = false;
+	bool pass_through;
 	bool opt_append = false;
+	enum output_policy opt_policy = op_all;
+	unsigned long opt_policy_arg = 0;
+	bool lossy_outputs = false;
 
-	while ((ch = getopt(argc, argv, "ab:fIi:Mm:o:p:S:sTt:")) != -1) {
+	while ((ch = getopt(argc, argv, "ab:Cfg:HIi:j:k:L:l:Mm:o:P:p:qS:sTt:z")) != -1) {
+		if (ch != 'p')
+			opt_process = true;
 		switch (ch) {
 		case 'a':
 			opt_append = true;
@@ -1214,9 +5102,27 @@ main(int argc, char *argv[])
 		case 'b':
 			buffer_size = (int)parse_size(progname, optarg);
 			break;
+		case 'C':
+			opt_compress = true;
+			break;
 		case 'f':
 			use_tmp_file = true;
 			break;
+		case 'g':
+			if (strcmp(optarg, "concatenate") == 0)
+				gather_mode = gm_concatenate;
+			else if (strcmp(optarg, "merge") == 0)
+				gather_mode = gm_merge;
+			else if (strcmp(optarg, "seq") == 0)
+				gather_mode = gm_seq;
+			else if (strcmp(optarg, "any") == 0)
+				gather_mode = gm_any;
+			else
+				usage(progname);
+			break;
+		case 'H':
+			opt_huge_pages = true;
+			break;
 		case 'I':
 			state = read_ib;
 			break;
@@ -1225,14 +5131,28 @@ main(int argc, char *argv[])
 
 			if ((ifp->fd = open(optarg, O_RDONLY)) < 0)
 				err(2, "Error opening %s", optarg);
-			max_fd = MAX(ifp->fd, max_fd);
 			non_block(ifp->fd, fp_name(ifp));
 			/* Add file at the end of the linked list */
 			*iend = ifp;
 			iend = &ifp->next;
 			break;
+		case 'j':
+			if ((opt_writers = atoi(optarg)) <= 0)
+				usage(progname);
+			break;
+		case 'k':
+			parse_sort_key(progname, optarg);
+			break;
+		case 'L':
+			parse_output_policy(progname, optarg, &opt_policy, &opt_policy_arg);
+			break;
+		case 'l':
+			if ((block_len = parse_size(progname, optarg)) == 0)
+				usage(progname);
+			break;
 		case 'm':
 			max_mem = parse_size(progname, optarg);
+			opt_max_mem = true;
 			break;
 		case 'M':	/* Provide memory use statistics on termination */
 			opt_memory_stats = true;
@@ -1243,18 +5163,49 @@ main(int argc, char *argv[])
 					(opt_append ? O_APPEND : 0) |
 					O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
 				err(2, "Error opening %s", optarg);
-			max_fd = MAX(ofp->fd, max_fd);
 			non_block(ofp->fd, fp_name(ofp));
+			ofp->policy = opt_policy;
+			ofp->policy_arg = opt_policy_arg;
+			ofp->rate_allowance = opt_policy_arg;
+			if (opt_policy != op_all)
+				lossy_outputs = true;
 			/* Add file at the end of the linked list */
 			*oend = ofp;
 			oend = &ofp->next;
 			break;
+		case 'P':
+			if ((opt_pipe_size = parse_size(progname, optarg)) == 0)
+				usage(progname);
+			break;
 		case 'p':
 			parse_permute(optarg);
 			break;
+		case 'q':
+			opt_seq_tags = true;
+			break;
 		case 's':
 			opt_scatter = true;
 			break;
+		case 'S':
+			if (strcmp(optarg, "equal") == 0)
+				scatter_policy = sp_equal;
+			else if (strcmp(optarg, "outstanding") == 0)
+				scatter_policy = sp_outstanding;
+			else if (strcmp(optarg, "rate") == 0)
+				scatter_policy = sp_rate;
+			else if (strcmp(optarg, "hash") == 0)
+				scatter_policy = sp_hash;
+			else if (strcmp(optarg, "range") == 0)
+				scatter_policy = sp_range;
+			else if (strncmp(optarg, "range=", 6) == 0) {
+				scatter_policy = sp_range;
+				if ((range_sample = parse_size(progname, optarg + 6)) == 0)
+					usage(progname);
+			} else if (strcmp(optarg, "split") == 0)
+				scatter_policy = sp_split;
+			else
+				usage(progname);
+			break;
 		case 'T':
 			opt_tmp_dir = optarg;
 			break;
@@ -1264,6 +5215,9 @@ main(int argc, char *argv[])
 				usage(progname);
 			rt = *optarg;
 			break;
+		case 'z':
+			opt_zero_copy = true;
+			break;
 		case '?':
 		default:
 			usage(progname);
@@ -1310,11 +5264,25 @@ main(int argc, char *argv[])
 
 
 
+	/*
+	 * Without options other than a permutation, inputs copied to
+	 * equally many outputs can be connected to them during the
+	 * negotiation, rather than being buffered.
+	 */
+	pass_through = !opt_process;
+	if (pass_through)
+		dgsh_pass_through(permute_n ? permute_dest : NULL, permute_n);
+
 	DPRINTF(3, "Calling negotiate in=%d out=%d", ninputfds, noutputfds);
 	dgsh_negotiate(DGSH_HANDLE_ERROR, name, &ninputfds, &noutputfds, &inputfds, &outputfds);
 	DPRINTF(3, "nin=%d nout=%d", ninputfds, noutputfds);
 	assert(noutputfds >= 0);
 	assert(ninputfds >= 0);
+	if (pass_through && ninputfds == 0 && noutputfds == 0) {
+		DPRINTF(3, "Inputs passed through to the outputs");
+		return 0;
+	}
+	graph_setup(progname);
 
 	if (permute_n && permute_n != ninputfds)
 		errx(1, "The number of inputs %d is not equal to the specified permuted outputs %d", ninputfds, permute_n);
@@ -1330,7 +5298,6 @@ main(int argc, char *argv[])
 			ofp = new_sink_info(NULL);
 			ofp->fd = outputfds[j];
 		}
-		max_fd = MAX(ofp->fd, max_fd);
 		non_block(ofp->fd, fp_name(ofp));
 		/* Add file at the end of the linked list */
 		*oend = ofp;
@@ -1346,7 +5313,6 @@ main(int argc, char *argv[])
 			ifp = new_source_info(NULL);
 			ifp->fd = inputfds[j];
 		}
-		max_fd = MAX(ifp->fd, max_fd);
 		non_block(ifp->fd, fp_name(ifp));
 		/* Add file at the end of the linked list */
 		*iend = ifp;
@@ -1356,17 +5322,42 @@ main(int argc, char *argv[])
 	if (buffer_size > max_mem)
 		errx(1, "Buffer size %d is larger than the program's maximum memory limit %lu", buffer_size, max_mem);
 
-	if (opt_scatter && ifiles && ifiles->next)
-		errx(1, "Scattering not supported with more than one input file");
+	/* Without a temporary file a whole block must fit in memory */
+	if (block_len > max_mem && !use_tmp_file)
+		errx(1, "Block size %zu is larger than the program's maximum memory limit %lu", block_len, max_mem);
 
 	if (opt_scatter && permute_n)
 		errx(1, "Scattering and permutation cannot be used together");
 
+	if (gather_mode != gm_concatenate && permute_n)
+		errx(1, "Merging or sequencing and permutation cannot be used together");
+
+	if (opt_seq_tags && (!opt_scatter || block_len))
+		errx(1, "Sequence tags can only be used when scattering lines");
+
+	if (partitioning() && (!opt_scatter || block_len || opt_seq_tags))
+		errx(1, "Partitioning can only be used when scattering lines without sequence tags");
+
+	if (scatter_policy == sp_split && (!opt_scatter || opt_seq_tags))
+		errx(1, "Splitting can only be used when scattering without sequence tags");
+
+	if (lossy_outputs && (opt_scatter || opt_writers || opt_zero_copy))
+		errx(1, "Lossy outputs can only be used when copying data through the event loop");
+
+	if (opt_compress && !use_tmp_file)
+		errx(1, "Compression can only be used with a temporary file");
+
+	if (opt_writers && (use_tmp_file || opt_zero_copy))
+		errx(1, "Writer threads cannot be used with a temporary file or zero-copy transfers");
+
+	if (opt_writers && (gather_mode != gm_concatenate || partitioning() ||
+	    scatter_policy == sp_split))
+		errx(1, "Writer threads can only be used with concatenated inputs and unpartitioned outputs");
+
 	if (ofiles == NULL) {
 		/* Output to stdout */
 		ofp = new_sink_info("standard output");
 		ofp->fd = STDOUT_FILENO;
-		max_fd = MAX(ofp->fd, max_fd);
 		non_block(ofp->fd, fp_name(ofp));
 		ofp->next = ofiles;
 		ofiles = ofp;
@@ -1376,7 +5367,6 @@ main(int argc, char *argv[])
 		/* Input from stdin */
 		ifp = new_source_info("standard input");
 		ifp->fd = STDIN_FILENO;
-		max_fd = MAX(ifp->fd, max_fd);
 		non_block(ifp->fd, fp_name(ifp));
 		ifp->next = ifiles;
 		ifiles = ifp;
@@ -1386,69 +5376,153 @@ main(int argc, char *argv[])
 	signal(SIGPIPE, SIG_IGN);
 
 	front_ifp = ifiles;
-	chain_io_files(ifiles, ofiles, permute_n != 0);
+	if (gather_mode != gm_concatenate) {
+		gather_setup(ifiles);
+		write_ifiles = gather_ifp;
+	} else
+		write_ifiles = ifiles;
+	chain_io_files(write_ifiles, ofiles, permute_n != 0);
+	if (partitioning())
+		write_ifiles = partition_setup(write_ifiles, ofiles);
+
+	/* Serve regular files from memory mappings and copy them within the kernel */
+	for (ifp = ifiles; ifp; ifp = ifp->next)
+		source_map(ifp);
+	for (ofp = ofiles; ofp; ofp = ofp->next)
+		sink_copy_setup(ofp);
+	if (scatter_policy == sp_split && !split_setup(ifiles, ofiles)) {
+		DPRINTF(2, "Unable to split %s; scattering it equally", fp_name(ifiles));
+		scatter_policy = sp_equal;
+	}
+
+	if (opt_pipe_size) {
+		for (ifp = ifiles; ifp; ifp = ifp->next) {
+			ifp->pipe_size = pipe_size_set(ifp->fd);
+			ifp->read_avg = opt_pipe_size / 2;
+		}
+		for (ofp = ofiles; ofp; ofp = ofp->next)
+			ofp->pipe_size = pipe_size_set(ofp->fd);
+	}
+
+	if (opt_zero_copy) {
+		for (ifp = ifiles; ifp; ifp = ifp->next)
+			ifp->is_pipe = is_pipe(ifp->fd);
+		for (ofp = ofiles; ofp; ofp = ofp->next)
+			ofp->is_pipe = is_pipe(ofp->fd);
+	}
+
+	if (use_tmp_file)
+		page_setup(ofiles);
+	stats_setup();
+
+	if (scatter_policy == sp_split) {
+		event_setup(NULL, ofiles);
+		split_run(ifiles, ofiles);
+		if (opt_memory_stats)
+			memory_stats(ifiles);
+		if (opt_memory_stats && opt_pipe_size)
+			io_stats(ifiles, ofiles);
+		return 0;
+	}
+
+	if (opt_writers) {
+		engine_setup(ifiles, ofiles);
+		engine_run(state);
+		if (opt_memory_stats)
+			memory_stats(ifiles);
+		if (opt_memory_stats && opt_pipe_size)
+			io_stats(ifiles, ofiles);
+		return 0;
+	}
+
+	event_setup(ifiles, ofiles);
 
 	/* Copy source to sink without allowing any single file to block us. */
 	for (;;) {
-		fd_set source_fds;
-		fd_set sink_fds;
-		int fd_set_count = 0;
+		int wait_count = 0;
+		bool ready = false;
 
+		if (gather_mode != gm_concatenate)
+			gather_records(ifiles);
+		if (partitioning())
+			partition_records();
 		show_state(state);
-		/* Set the fd's we're interested to read/write; close unneeded ones. */
-		FD_ZERO(&source_fds);
-		FD_ZERO(&sink_fds);
-
+		/* Mark the fd's we're interested to read/write. */
+		for (ifp = ifiles; ifp; ifp = ifp->next)
+			ifp->wait = false;
 		if (!reached_eof)
 			switch (state) {
 			case read_ib:
 				for (ifp = front_ifp; ifp; ifp = ifp->next)
-					if (!ifp->reached_eof) {
-						FD_SET(ifp->fd, &source_fds);
-						fd_set_count += 1;
-					}
+					if (!ifp->reached_eof)
+						ifp->wait = true;
 				break;
 			case read_ob:
 				for (ifp = front_ifp; ifp; ifp = ifp->next)
-					if (ifp->active && !ifp->reached_eof) {
-						FD_SET(ifp->fd, &source_fds);
-						fd_set_count += 1;
-					}
+					/* Inputs being gathered or partitioned get backpressure. */
+					if (ifp->active && !ifp->reached_eof &&
+					    ((gather_mode == gm_concatenate && !partitioning()) ||
+					    gather_reads(ifp)))
+						ifp->wait = true;
 				break;
 			default:
 				break;
 			}
+		for (ifp = front_ifp; ifp; ifp = ifp->next)
+			if (ifp->wait) {
+				ready |= ifp->ready;
+				wait_count += 1;
+			}
 
-		for (ofp = ofiles; ofp; ofp = ofp->next)
-			if (ofp->active) {
-				switch (state) {
-				case read_ib:
-				case read_ob:
-				case drain_ob:
-					DPRINTF(4, "Check active file[%s] pos_written=%ld pos_to_write=%ld",
-						fp_name(ofp), (long)ofp->pos_written, (long)ofp->pos_to_write);
-					if (ofp->pos_written < ofp->pos_to_write) {
-						FD_SET(ofp->fd, &sink_fds);
-						fd_set_count += 1;
-					}
-					break;
-				case drain_ib:
-				case write_ob:
-					FD_SET(ofp->fd, &sink_fds);
-					fd_set_count += 1;
-					break;
-				}
+		for (ofp = ofiles; ofp; ofp = ofp->next) {
+			ofp->wait = false;
+			if (!ofp->active)
+				continue;
+			switch (state) {
+			case read_ib:
+			case read_ob:
+			case drain_ob:
+				DPRINTF(4, "Check active file[%s] pos_written=%ld pos_to_write=%ld",
+					fp_name(ofp), (long)ofp->pos_written, (long)ofp->pos_to_write);
+				if (sink_pending(ofp))
+					ofp->wait = true;
+				break;
+			case drain_ib:
+			case write_ob:
+				ofp->wait = true;
+				break;
+			}
+			/* Sinks waiting for data being paged in wait for the paging thread. */
+			if (ofp->wait && ofp->pos_written < ofp->pos_to_write &&
+			    ofp->ifp->bp->buffers[ofp->pos_written / buffer_size].s == s_paging_in)
+				ofp->wait = false;
+			if (ofp->wait) {
+				ready |= ofp->ready;
+				wait_count += 1;
 			}
+		}
+
+		if (page_jobs) {
+			ready |= page_ready;
+			wait_count += 1;
+		}
+
+		if (wait_count != 0) {
+			/*
+			 * Block until we can read or write, unless some
+			 * I/O is already known to be possible.
+			 */
+			show_wait_args("Entering wait", ifiles, ofiles, true);
+			event_wait(ifiles, ofiles, !ready);
+			show_wait_args("Wait returned", ifiles, ofiles, false);
 
-		if (fd_set_count != 0) {
-			/* Block until we can read or write. */
-			show_select_args("Entering select", &source_fds, ifiles, &sink_fds, ofiles, true);
-			if (select(max_fd + 1, &source_fds, &sink_fds, NULL, NULL) < 0)
-				err(3, "select");
-			show_select_args("Select returned", &source_fds, ifiles, &sink_fds, ofiles, false);
+			if (page_ready)
+				page_complete();
+			if (stats_ready)
+				live_stats(state, ifiles, ofiles);
 
 			/* Write to all file descriptors that accept writes. */
-			if (sink_write(ifiles, &sink_fds, ofiles) > 0) {
+			if (sink_write(write_ifiles, ofiles) > 0) {
 				/*
 				* If we wrote something, we made progress on the
 				* downstream end.  Loop without reading to avoid
@@ -1459,13 +5533,14 @@ main(int argc, char *argv[])
 				continue;
 			}
 		}
-		
-		if (reached_eof) {
+
+		if (reached_eof && (gather_mode == gm_concatenate || gather_ifp->reached_eof) &&
+		    (!partitioning() || write_ifiles->reached_eof)) {
 			int active_fds = 0;
 
 			for (ofp = ofiles; ofp; ofp = ofp->next)
 				if (ofp->active) {
-					if (ofp->pos_written < ofp->pos_to_write)
+					if (sink_pending(ofp))
 						active_fds++;
 					else {
 						DPRINTF(3, "Retiring file %s pos_written=pos_to_write=%ld source_pos_read=%ld",
@@ -1478,8 +5553,15 @@ main(int argc, char *argv[])
 				}
 			if (active_fds == 0) {
 				/* If no read possible, and no writes pending, terminate. */
-				if (opt_memory_stats)
+				if (opt_memory_stats) {
 					memory_stats(ifiles);
+					if (gather_mode != gm_concatenate)
+						memory_stats(gather_ifp);
+					if (partitioning())
+						memory_stats(write_ifiles);
+					if (opt_pipe_size)
+						io_stats(ifiles, ofiles);
+				}
 				return 0;
 			}
 		}
@@ -1493,8 +5575,8 @@ main(int argc, char *argv[])
 			/* Read, if possible; set global reached_eof if all have reached it */
 			reached_eof = true;
 			for (ifp = front_ifp; ifp; ifp = ifp->next) {
-				if (FD_ISSET(ifp->fd, &source_fds))
-					switch (source_read(ifp)) {
+				if (fp_ready(ifp))
+					switch (source_transfer(ifp, ofiles)) {
 					case read_eof:
 						ifp->reached_eof = true;
 						break;
@@ -1517,8 +5599,8 @@ main(int argc, char *argv[])
 			for (ifp = front_ifp; ifp; ifp = ifp->next) {
 				if (!ifp->active)
 					continue;
-				if (FD_ISSET(ifp->fd, &source_fds))
-					switch (source_read(ifp)) {
+				if (fp_ready(ifp))
+					switch (source_transfer(ifp, ofiles)) {
 					case read_eof:
 						ifp->reached_eof = true;
 						ifp->active = false;
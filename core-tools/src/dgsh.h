@@ -26,4 +26,10 @@ int
 dgsh_negotiate(int flags, const char *tool_name, int *n_input_fds,
 		int *n_output_fds, int **input_fds, int **output_fds);
 
+long
+dgsh_graph_id(void);
+
+void
+dgsh_pass_through(const int *route, int n);
+
 #endif
@@ -30,6 +30,7 @@
 #include <string.h>		/* memcpy() */
 #include <sysexits.h>		/* EX_PROTOCOL, EX_OK */
 #include <sys/socket.h>		/* sendmsg(), recvmsg() */
+#include <sys/un.h>		/* struct sockaddr_un */
 #include <unistd.h>		/* getpid(), getpagesize(),
 				 * STDIN_FILENO, STDOUT_FILENO,
 				 * STDERR_FILENO, alarm(), sysconf()
@@ -140,6 +141,16 @@ static struct dgsh_node_pipe_fds self_pipe_fds;	/* A tool's read and write file
 						 * descriptors to use at execution.
 						 */
 static bool init_error = false;
+static long graph_id = -1;			/* Identifier of the negotiated
+						 * graph, shared by its tools.
+						 */
+static bool pass_through = false;		/* The tool only routes its
+						 * inputs to its outputs.
+						 */
+static const int *pass_route;			/* Output of each input, or
+						 * NULL for the same one.
+						 */
+static int pass_route_n;			/* Number of routed inputs */
 static volatile sig_atomic_t negotiation_completed = 0;
 int dgsh_debug_level = 0;
 
@@ -1225,8 +1236,8 @@ solve_graph(void)
 	enum op_result exit_state = OP_SUCCESS;
 	int retries = 0;
 	int index_argc = 0;
-	int *index_commands_notmatched;
-	int *side_commands_notmatched;
+	int *index_commands_notmatched = NULL;
+	int *side_commands_notmatched = NULL;
 
 	/**
 	 * The initial layout of the solution plays an important
@@ -1438,6 +1449,74 @@ write_output_fds(int output_socket, int *output_fds, int flags)
 	return re;
 }
 
+/*
+ * Return the input routed to the specified output of a pass-through
+ * tool, or -1 if there is none.
+ */
+static int
+pass_input(int output)
+{
+	int i;
+
+	if (pass_route == NULL)
+		return output < self_pipe_fds.n_input_fds ? output : -1;
+	for (i = 0; i < pass_route_n; i++)
+		if (pass_route[i] == output)
+			return i;
+	return -1;
+}
+
+/*
+ * Return true if the negotiated inputs of a pass-through tool can be
+ * passed in place of its outputs: its inputs and outputs are all
+ * negotiated pipes, and each output is routed an input.
+ */
+static bool
+can_pass_through(void)
+{
+	int i;
+
+	if (!pass_through || !self_node.dgsh_in || !self_node.dgsh_out ||
+	    self_pipe_fds.n_input_fds == 0 ||
+	    self_pipe_fds.n_input_fds != self_pipe_fds.n_output_fds ||
+	    (pass_route && pass_route_n != self_pipe_fds.n_input_fds))
+		return false;
+	for (i = 0; i < self_pipe_fds.n_output_fds; i++)
+		if (pass_input(i) == -1)
+			return false;
+	return true;
+}
+
+/*
+ * Transmit the file descriptors of a pass-through tool's inputs
+ * in place of the pipes that would carry its outputs, so that the
+ * tools reading them read directly from the tools writing its inputs.
+ * The tool is left without file descriptors to process.
+ */
+static enum op_result
+pass_input_fds(int output_socket, int *n_input_fds, int *n_output_fds)
+{
+	int i;
+
+	for (i = 0; i < self_pipe_fds.n_output_fds; i++) {
+		DPRINTF(4, "%s(): pass input %d as output %d", __func__,
+				pass_input(i), i);
+		write_fd(output_socket, self_pipe_fds.input_fds[pass_input(i)]);
+	}
+	for (i = 0; i < self_pipe_fds.n_input_fds; i++)
+		close(self_pipe_fds.input_fds[i]);
+	free(self_pipe_fds.input_fds);
+	free(self_pipe_fds.output_fds);
+	self_pipe_fds.n_input_fds = self_pipe_fds.n_output_fds = 0;
+	if (n_input_fds)
+		*n_input_fds = 0;
+	if (n_output_fds)
+		*n_output_fds = 0;
+	DPRINTF(2, "%s(): node %s at index %d passed through its inputs",
+			__func__, self_node.name, self_node.index);
+	return OP_SUCCESS;
+}
+
 static int
 write_piece (int write_fd, void *datastruct, int struct_size)
 {
@@ -2763,11 +2842,491 @@ state_name(enum prot_state s)
 		return "RUN";
 	case PS_ERROR:
 		return "ERROR";
+	case PS_DRAW_EXIT:
+		return "DRAW_EXIT";
 	default:
 		assert(0);
 	}
 }
 
+/* Write all n bytes of buf to fd; return false on failure */
+static bool
+write_all(int fd, const void *buf, size_t n)
+{
+	const char *p = buf;
+	ssize_t written;
+
+	while (n > 0) {
+		if ((written = write(fd, p, n)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += written;
+		n -= written;
+	}
+	return true;
+}
+
+/*
+ * Read exactly n bytes from fd into buf, without consuming any
+ * file descriptors that follow them; return false on failure.
+ */
+static bool
+read_all(int fd, void *buf, size_t n)
+{
+	char *p = buf;
+	ssize_t nread;
+
+	while (n > 0) {
+		if ((nread = read(fd, p, n)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (nread == 0) {
+			errno = ECONNRESET;
+			return false;
+		}
+		p += nread;
+		n -= nread;
+	}
+	return true;
+}
+
+/*
+ * Return a connection to the negotiation broker advertised through
+ * the DGSH_BROKER environment variable, or -1 if there is none.
+ */
+int
+broker_connect(void)
+{
+	struct sockaddr_un addr;
+	const char *path;
+	int s;
+
+	if ((path = getenv("DGSH_BROKER")) == NULL || *path == '\0')
+		return -1;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		errx(EX_PROTOCOL, "Broker socket path %s is too long", path);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(EX_PROTOCOL, "socket");
+	if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+		err(EX_PROTOCOL, "Unable to connect to negotiation broker %s",
+				path);
+	DPRINTF(3, "%s(): connected to broker %s", __func__, path);
+	return s;
+}
+
+/*
+ * Exchange pids with the process at the other end of the negotiation
+ * socket sock, and return the peer's pid.
+ * This lets a broker piece the graph together from its processes'
+ * registrations.
+ */
+pid_t
+peer_pid(int sock, pid_t self_pid)
+{
+	pid_t pid;
+
+	if (!write_all(sock, &self_pid, sizeof(self_pid)))
+		err(EX_PROTOCOL, "Unable to send pid on fd %d", sock);
+	if (!read_all(sock, &pid, sizeof(pid)))
+		err(EX_PROTOCOL, "Unable to read peer pid on fd %d", sock);
+	DPRINTF(4, "%s(): fd %d is connected to pid %d", __func__, sock,
+			(int)pid);
+	return pid;
+}
+
+/*
+ * Send a process's registration to the broker and wait for its reply.
+ * Return the state of the negotiation in the reply.
+ */
+enum prot_state
+broker_register(int broker, const struct broker_request *req,
+		const pid_t *ports, struct broker_reply *reply)
+{
+	if (!write_all(broker, req, sizeof(*req)) ||
+	    !write_all(broker, ports, req->n_ports * sizeof(*ports)))
+		err(EX_PROTOCOL, "Unable to register with negotiation broker");
+	if (!read_all(broker, reply, sizeof(*reply)))
+		err(EX_PROTOCOL, "Unable to read negotiation broker's reply");
+	DPRINTF(2, "%s(): %s (%d) received state %s, %d input, %d output fds",
+			__func__, req->name, (int)req->pid,
+			state_name(reply->state), reply->n_input_fds,
+			reply->n_output_fds);
+	return reply->state;
+}
+
+/*
+ * Negotiate through a broker: register the tool together with the
+ * processes at its negotiation ports, and receive the file descriptors
+ * of the solution in a single round trip.
+ * Return the negotiation's final state.
+ */
+static enum prot_state
+broker_negotiate(int broker, const char *tool_name, pid_t self_pid,
+		int *n_input_fds, int *n_output_fds)
+{
+	struct broker_request req;
+	struct broker_reply reply;
+	enum prot_state state;
+	pid_t ports[2];
+	int i;
+
+	fill_node(tool_name, self_pid, n_input_fds, n_output_fds);
+	memset(&req, 0, sizeof(req));
+	req.pid = self_pid;
+	snprintf(req.name, sizeof(req.name), "%s", tool_name);
+	req.requires_channels = self_node.requires_channels;
+	req.provides_channels = self_node.provides_channels;
+	req.error = init_error;
+	req.n_ports = 2;
+	ports[STDIN_FILENO] = self_node.dgsh_in ?
+		peer_pid(STDIN_FILENO, self_pid) : 0;
+	ports[STDOUT_FILENO] = self_node.dgsh_out ?
+		peer_pid(STDOUT_FILENO, self_pid) : 0;
+
+	if ((state = broker_register(broker, &req, ports, &reply)) != PS_RUN) {
+		errno = 0;
+		goto out;
+	}
+	graph_id = reply.graph_id;
+	self_pipe_fds.n_input_fds = reply.n_input_fds;
+	self_pipe_fds.n_output_fds = reply.n_output_fds;
+	if (alloc_fds(&self_pipe_fds.input_fds, reply.n_input_fds) ==
+			OP_ERROR ||
+	    alloc_fds(&self_pipe_fds.output_fds, reply.n_output_fds) ==
+			OP_ERROR) {
+		state = PS_ERROR;
+		goto out;
+	}
+	for (i = 0; i < reply.n_input_fds; i++)
+		self_pipe_fds.input_fds[i] = read_fd(broker);
+	for (i = 0; i < reply.n_output_fds; i++)
+		self_pipe_fds.output_fds[i] = read_fd(broker);
+	state = PS_COMPLETE;
+out:
+	close(broker);
+	return state;
+}
+
+/*
+ * Read into client the part of a process's registration that is
+ * available on its non-blocking connection, so that a slow process
+ * cannot stall the broker.
+ * Return OP_RETRY while the registration is incomplete.
+ */
+enum op_result
+broker_read_request(struct broker_client *client)
+{
+	size_t ports_size, size;
+	ssize_t nread;
+	char *p;
+
+	for (;;) {
+		if (client->nread < sizeof(client->req)) {
+			p = (char *)&client->req + client->nread;
+			size = sizeof(client->req) - client->nread;
+		} else {
+			if (client->req.n_ports < 1 ||
+			    client->req.n_ports > 65536)
+				return OP_ERROR;
+			ports_size = client->req.n_ports * sizeof(pid_t);
+			if (client->ports == NULL &&
+			    (client->ports = malloc(ports_size)) == NULL)
+				return OP_ERROR;
+			size = sizeof(client->req) + ports_size - client->nread;
+			if (size == 0)
+				break;
+			p = (char *)client->ports + ports_size - size;
+		}
+		if ((nread = read(client->fd, p, size)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return OP_RETRY;
+			return OP_ERROR;
+		}
+		if (nread == 0)
+			return OP_ERROR;
+		client->nread += nread;
+	}
+	client->req.name[sizeof(client->req.name) - 1] = '\0';
+	DPRINTF(2, "%s(): %s (%d) registered with %d ports", __func__,
+			client->req.name, (int)client->req.pid,
+			client->req.n_ports);
+	return OP_SUCCESS;
+}
+
+/* Return the index of the client with the specified pid, or -1. */
+static int
+broker_find(struct broker_client *clients, int n_clients, pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < n_clients; i++)
+		if (clients[i].req.pid == pid)
+			return i;
+	return -1;
+}
+
+/*
+ * Append to nodes the graph nodes of the tools whose data flow
+ * through the process with the specified pid, downstream from it
+ * if down is true, otherwise upstream.
+ * Concentrators are traversed in the order of their ports, which
+ * is the order of the corresponding file descriptors.
+ */
+static void
+broker_expand(struct broker_client *clients, int n_clients,
+		const int *node_of, pid_t pid, bool down, int *nodes, int *n)
+{
+	struct broker_client *c;
+	int i, p;
+
+	if (pid == 0 || (i = broker_find(clients, n_clients, pid)) == -1)
+		return;
+	c = &clients[i];
+	if (!c->req.is_conc) {
+		for (p = 0; p < *n; p++)
+			if (nodes[p] == node_of[i])
+				return;
+		nodes[(*n)++] = node_of[i];
+		return;
+	}
+	/* An input conc outputs on port 1, an output conc on all but 0 */
+	for (p = 0; p < c->req.n_ports; p++)
+		if ((c->req.multiple_inputs ? p == 1 : p != 0) == down)
+			broker_expand(clients, n_clients, node_of,
+					c->ports[p], down, nodes, n);
+}
+
+/* Return the index of the edge from node from to node to, or -1. */
+static int
+broker_edge(int from, int to)
+{
+	int i;
+
+	for (i = 0; i < chosen_mb->n_edges; i++)
+		if (chosen_mb->edge_array[i].from == from &&
+		    chosen_mb->edge_array[i].to == to)
+			return i;
+	return -1;
+}
+
+/*
+ * Solve the graph of the processes registered with a broker,
+ * and set in their replies the negotiation's outcome.
+ * Tools connected through concentrators are connected directly,
+ * with the pipes of each edge assigned to the tools' file descriptors
+ * in the order the concentrators would pass them.
+ */
+enum op_result
+broker_solve(struct broker_client *clients, int n_clients)
+{
+	struct broker_client *c;
+	int *node_of, *client_of, *peers, **edge_fds = NULL;
+	int i, j, k, e, n_peers, n_nodes = 0;
+	enum prot_state state = PS_RUN;
+	pid_t graph_pid = 0;
+
+	node_of = malloc(n_clients * sizeof(int));
+	client_of = malloc(n_clients * sizeof(int));
+	peers = malloc(n_clients * sizeof(int));
+	if (!node_of || !client_of || !peers ||
+	    construct_message_block("dgsh-broker", getpid()) == OP_ERROR ||
+	    (chosen_mb->node_array = malloc(n_clients *
+			sizeof(struct dgsh_node))) == NULL)
+		errx(1, "Out of memory");
+
+	/* Model each tool as a node; the graph is named after the first */
+	for (i = 0; i < n_clients; i++) {
+		struct broker_request *r = &clients[i].req;
+		struct dgsh_node *n = &chosen_mb->node_array[n_nodes];
+
+		if (r->error)
+			state = PS_ERROR;
+		if (r->is_conc) {
+			node_of[i] = -1;
+			continue;
+		}
+		n->pid = r->pid;
+		n->index = n_nodes;
+		memcpy(n->name, r->name, sizeof(n->name));
+		n->requires_channels = r->requires_channels;
+		n->provides_channels = r->provides_channels;
+		n->dgsh_in = clients[i].ports[STDIN_FILENO] != 0;
+		n->dgsh_out = clients[i].ports[STDOUT_FILENO] != 0;
+		if (graph_pid == 0 || r->pid < graph_pid)
+			graph_pid = r->pid;
+		node_of[i] = n_nodes;
+		client_of[n_nodes++] = i;
+	}
+	chosen_mb->n_nodes = n_nodes;
+	chosen_mb->initiator_pid = graph_pid;
+	if (n_nodes == 0)
+		state = PS_ERROR;
+
+	/* Connect each tool to the tools its output reaches */
+	for (i = 0; i < n_nodes && state == PS_RUN; i++) {
+		n_peers = 0;
+		broker_expand(clients, n_clients, node_of,
+				clients[client_of[i]].ports[STDOUT_FILENO],
+				true, peers, &n_peers);
+		for (j = 0; j < n_peers; j++) {
+			struct dgsh_edge edge = { i, peers[j], 0, 0, 0 };
+
+			if (lookup_dgsh_edge(&edge) == OP_CREATE &&
+			    add_edge(&edge) == OP_ERROR)
+				state = PS_ERROR;
+		}
+	}
+
+	if (state == PS_RUN) {
+		DPRINTF(1, "%s(): Gathered I/O requirements of %d tools.",
+				__func__, n_nodes);
+		switch (solve_graph()) {
+		case OP_ERROR:
+			state = PS_ERROR;
+			break;
+		case OP_DRAW_EXIT:
+			state = PS_DRAW_EXIT;
+			break;
+		default:
+			DPRINTF(1, "%s(): Computed solution", __func__);
+			break;
+		}
+	}
+
+	/*
+	 * Create the pipes of each edge, with the write sides ordered
+	 * by the writer's outputs, and then distribute the read sides
+	 * in the order of the readers' inputs.
+	 */
+	if (state == PS_RUN && (edge_fds = calloc(chosen_mb->n_edges,
+			sizeof(int *))) == NULL)
+		state = PS_ERROR;
+	for (i = 0; i < n_nodes && state == PS_RUN; i++) {
+		c = &clients[client_of[i]];
+		n_peers = 0;
+		broker_expand(clients, n_clients, node_of,
+				c->ports[STDOUT_FILENO], true, peers, &n_peers);
+		for (j = 0; j < n_peers; j++)
+			c->reply.n_output_fds += chosen_mb->edge_array[
+				broker_edge(i, peers[j])].instances;
+		if (alloc_fds(&c->output_fds, c->reply.n_output_fds) ==
+				OP_ERROR) {
+			state = PS_ERROR;
+			break;
+		}
+		c->reply.n_output_fds = 0;
+		for (j = 0; j < n_peers && state == PS_RUN; j++) {
+			e = broker_edge(i, peers[j]);
+			if (alloc_fds(&edge_fds[e],
+				chosen_mb->edge_array[e].instances) == OP_ERROR)
+				state = PS_ERROR;
+			for (k = 0; k < chosen_mb->edge_array[e].instances &&
+					state == PS_RUN; k++)
+				edge_fds[e][k] = -1;
+			for (k = 0; k < chosen_mb->edge_array[e].instances &&
+					state == PS_RUN; k++) {
+				int fd[2];
+
+				if (pipe(fd) == -1) {
+					warn("pipe");
+					state = PS_ERROR;
+					break;
+				}
+				edge_fds[e][k] = fd[0];
+				c->output_fds[c->reply.n_output_fds++] = fd[1];
+			}
+		}
+	}
+	for (i = 0; i < n_nodes && state == PS_RUN; i++) {
+		c = &clients[client_of[i]];
+		n_peers = 0;
+		broker_expand(clients, n_clients, node_of,
+				c->ports[STDIN_FILENO], false, peers, &n_peers);
+		for (j = 0; j < n_peers; j++)
+			c->reply.n_input_fds += chosen_mb->edge_array[
+				broker_edge(peers[j], i)].instances;
+		if (alloc_fds(&c->input_fds, c->reply.n_input_fds) ==
+				OP_ERROR) {
+			state = PS_ERROR;
+			break;
+		}
+		c->reply.n_input_fds = 0;
+		for (j = 0; j < n_peers; j++) {
+			e = broker_edge(peers[j], i);
+			for (k = 0; k < chosen_mb->edge_array[e].instances; k++)
+				c->input_fds[c->reply.n_input_fds++] =
+					edge_fds[e][k];
+		}
+	}
+
+	/* After a failure close the pipes created, through their edges */
+	for (i = 0; i < n_clients; i++) {
+		c = &clients[i];
+		if (state != PS_RUN) {
+			for (j = 0; j < c->reply.n_output_fds; j++)
+				close(c->output_fds[j]);
+			c->reply.n_input_fds = c->reply.n_output_fds = 0;
+		}
+		c->reply.state = state;
+		c->reply.graph_id = graph_pid;
+	}
+	if (edge_fds)
+		for (e = 0; e < chosen_mb->n_edges; e++) {
+			if (state != PS_RUN && edge_fds[e])
+				for (k = 0; k < chosen_mb->edge_array[e].instances;
+						k++)
+					if (edge_fds[e][k] != -1)
+						close(edge_fds[e][k]);
+			free(edge_fds[e]);
+		}
+	free(edge_fds);
+	free(node_of);
+	free(client_of);
+	free(peers);
+	free_mb(chosen_mb);
+	chosen_mb = NULL;
+	return state == PS_ERROR ? OP_ERROR : OP_SUCCESS;
+}
+
+/*
+ * Send to a registered process the broker's reply and the file
+ * descriptors it carries, closing the broker's copies.
+ */
+enum op_result
+broker_send_reply(struct broker_client *client)
+{
+	enum op_result re = OP_SUCCESS;
+	int i;
+
+	if (!write_all(client->fd, &client->reply, sizeof(client->reply)))
+		re = OP_ERROR;
+	for (i = 0; i < client->reply.n_input_fds; i++) {
+		if (re == OP_SUCCESS)
+			write_fd(client->fd, client->input_fds[i]);
+		close(client->input_fds[i]);
+	}
+	for (i = 0; i < client->reply.n_output_fds; i++) {
+		if (re == OP_SUCCESS)
+			write_fd(client->fd, client->output_fds[i]);
+		close(client->output_fds[i]);
+	}
+	free(client->input_fds);
+	free(client->output_fds);
+	free(client->ports);
+	client->input_fds = client->output_fds = NULL;
+	client->ports = NULL;
+	return re;
+}
+
 /**
  * Each tool in the dgsh graph calls dgsh_negotiate() to take part in
  * peer-to-peer negotiation. A message block (MB) is circulated among tools
@@ -2776,6 +3335,9 @@ state_name(enum prot_state s)
  * all requirements. If a solution is found, pipes are allocated and
  * set up according to the solution. The appropriate file descriptors
  * are provided to each tool and the negotiation phase ends.
+ * When a broker is advertised through the DGSH_BROKER environment
+ * variable, the tool instead registers its requirements with the broker,
+ * which solves the whole graph and returns the tool's file descriptors.
  * The function's return value signifies success or failure of the
  * negotiation phase.
  */
@@ -2791,6 +3353,7 @@ dgsh_negotiate(int flags, const char *tool_name, int *n_input_fds,
 	struct dgsh_negotiation *fresh_mb = NULL; /* MB just read. */
 
 	int nfds = 0, n_io_sides;
+	int broker;
 	bool isread = false;
 	fd_set read_fds, write_fds;
 	char *timeout;
@@ -2850,6 +3413,21 @@ dgsh_negotiate(int flags, const char *tool_name, int *n_input_fds,
 	else
 		alarm(DGSH_TIMEOUT);
 
+	/* Negotiate through a broker, if one is set up */
+	if ((broker = broker_connect()) != -1) {
+		enum prot_state state = broker_negotiate(broker, tool_name,
+				self_pid, n_input_fds, n_output_fds);
+
+		if (state == PS_COMPLETE && establish_io_connections(input_fds,
+				n_input_fds, output_fds, n_output_fds) ==
+				OP_ERROR)
+			state = PS_ERROR;
+		negotiation_completed = 1;
+		alarm(0);
+		signal(SIGALRM, SIG_IGN);
+		return dgsh_exit(state, flags);
+	}
+
 	/* Start negotiation */
 	if (self_node.dgsh_out && !self_node.dgsh_in) {
 #ifdef TIME
@@ -2961,17 +3539,25 @@ exit:
 			programname, self_node.index, isread ? "read" : "write",
 			state_name(chosen_mb->state));
 	if (chosen_mb->state == PS_COMPLETE) {
+		graph_id = chosen_mb->initiator_pid;
 		if (alloc_io_fds() == OP_ERROR)
 			chosen_mb->state = PS_ERROR;
 		if (read_input_fds(STDIN_FILENO, self_pipe_fds.input_fds) ==
 									OP_ERROR)
 			chosen_mb->state = PS_ERROR;
-		if (write_output_fds(STDOUT_FILENO,
-				self_pipe_fds.output_fds, flags) == OP_ERROR)
-			chosen_mb->state = PS_ERROR;
-		if (establish_io_connections(input_fds, n_input_fds, output_fds,
-						n_output_fds) == OP_ERROR)
-			chosen_mb->state = PS_ERROR;
+		if (chosen_mb->state == PS_COMPLETE && can_pass_through()) {
+			if (pass_input_fds(STDOUT_FILENO, n_input_fds,
+					n_output_fds) == OP_ERROR)
+				chosen_mb->state = PS_ERROR;
+		} else {
+			if (write_output_fds(STDOUT_FILENO,
+					self_pipe_fds.output_fds, flags) ==
+					OP_ERROR)
+				chosen_mb->state = PS_ERROR;
+			if (establish_io_connections(input_fds, n_input_fds,
+					output_fds, n_output_fds) == OP_ERROR)
+				chosen_mb->state = PS_ERROR;
+		}
 	} else if (chosen_mb->state == PS_DRAW_EXIT) {
 		if (n_input_fds != NULL)
 			*n_input_fds = 0;
@@ -2994,3 +3580,33 @@ exit:
 	signal(SIGALRM, SIG_IGN);	// Do not handle the signal
 	return dgsh_exit(state, flags);
 }
+
+/**
+ * Return an identifier of the graph negotiated by dgsh_negotiate(),
+ * which is the same for all the graph's tools and distinct from that
+ * of other running graphs, or -1 if the tool is not part of a graph.
+ * Tools can use it to name resources they share.
+ */
+long
+dgsh_graph_id(void)
+{
+	return graph_id;
+}
+
+/**
+ * Declare that the tool only passes its inputs unchanged to its outputs,
+ * input i to output route[i] (counting from 0) or, if route is NULL,
+ * to output i.  When the negotiated solution gives the tool as many
+ * pipe inputs as pipe outputs, dgsh_negotiate() then hands its inputs
+ * to the tools reading its outputs and returns no file descriptors,
+ * so that the tool can exit without copying any data.
+ * Must be called before dgsh_negotiate(); route must remain valid
+ * until then.
+ */
+void
+dgsh_pass_through(const int *route, int n)
+{
+	pass_through = true;
+	pass_route = route;
+	pass_route_n = n;
+}
@@ -163,7 +163,57 @@ struct dgsh_negotiation {
 
 };
 
+/*
+ * A process's registration with a negotiation broker.
+ * It is followed by the pids of the processes connected to each of
+ * its negotiation ports, or 0 for ports outside the dgsh graph.
+ * A tool's ports are its standard input and output; a concentrator's
+ * are its file descriptors 0, 1, 3, 4, ...
+ */
+struct broker_request {
+	pid_t pid;
+	char name[100];			/* Tool's name */
+	int requires_channels;		/* Input channels it can take */
+	int provides_channels;		/* Output channels it can provide */
+	bool is_conc;			/* True for a concentrator */
+	bool multiple_inputs;		/* True for an input concentrator */
+	bool error;			/* True if the process failed before
+					 * negotiating
+					 */
+	int n_ports;			/* Number of port pids that follow */
+};
+
+/*
+ * A broker's reply to a registration.
+ * On PS_RUN it is followed by the input and then the output
+ * file descriptors of the solution.
+ */
+struct broker_reply {
+	enum prot_state state;
+	long graph_id;			/* See dgsh_graph_id() */
+	int n_input_fds;
+	int n_output_fds;
+};
+
+/* A process registered with a negotiation broker */
+struct broker_client {
+	int fd;				/* Connection to the process */
+	size_t nread;			/* Registration bytes read so far */
+	struct broker_request req;
+	pid_t *ports;			/* Peers at the process's ports */
+	struct broker_reply reply;
+	int *input_fds;			/* Solution's fds, to be sent */
+	int *output_fds;
+};
+
 enum op_result solve_graph(void);
+int broker_connect(void);
+pid_t peer_pid(int sock, pid_t self_pid);
+enum prot_state broker_register(int broker, const struct broker_request *req,
+		const pid_t *ports, struct broker_reply *reply);
+enum op_result broker_read_request(struct broker_client *client);
+enum op_result broker_solve(struct broker_client *clients, int n_clients);
+enum op_result broker_send_reply(struct broker_client *client);
 enum op_result construct_message_block(const char *tool_name, pid_t pid);
 struct dgsh_conc *find_conc(struct dgsh_negotiation *mb, pid_t pid);
 pid_t get_origin_pid(struct dgsh_negotiation *mb);
@@ -0,0 +1,134 @@
+#!/bin/sh
+#
+# Throughput benchmarks for dgsh-tee
+# Run with the path of the dgsh-tee executable to benchmark
+# as an optional argument, e.g. for comparing two versions.
+#
+
+TOP=$(cd ../.. ; pwd)
+DGSH_TEE=${1:-$TOP/build/libexec/dgsh/dgsh-tee}
+DATA=bench-data
+SIZE_MB=${SIZE_MB:-256}
+NSINKS=16
+
+# Report the throughput of the dgsh-tee invocation with the arguments
+# passed as the second argument, reading $DATA through a pipe and
+# writing to pipes read by $NSINKS cat processes.
+bench()
+{
+	rm -f fifo.*
+	OUT=
+	for i in $(seq $NSINKS)
+	do
+		mkfifo fifo.$i
+		cat fifo.$i >/dev/null &
+		OUT="$OUT -o fifo.$i"
+	done
+	perl -MTime::HiRes=time -e '
+		$start = time;
+		system("cat '$DATA' | $ARGV[1]") == 0 || die "$ARGV[0] failed\n";
+		printf("%-40s %8.1f MB/s\n", $ARGV[0], '$SIZE_MB' / (time - $start));
+	' "$1" "$DGSH_TEE $2 $OUT"
+	wait
+	rm -f fifo.*
+}
+
+# Report the throughput and the temporary file paging of the dgsh-tee
+# invocation with the arguments passed as the second argument,
+# writing to a fast sink and to two sinks that lag at different rates.
+bench_lag()
+{
+	rm -f fifo.*
+	mkfifo fifo.1 fifo.2 fifo.3
+	cat fifo.1 >/dev/null &
+	for i in 2 3
+	do
+		perl -e 'while (sysread(STDIN, $b, 65536)) {
+			select(undef, undef, undef, $ARGV[0]) }' \
+			$(expr $i - 1)e-4 <fifo.$i &
+	done
+	perl -MTime::HiRes=time -e '
+		$start = time;
+		$stats = `cat '$DATA' | $ARGV[1] 2>&1 >/dev/null`;
+		$? == 0 || die "$ARGV[0] failed\n";
+		$stats =~ s/.*Page out: (\d+) In: (\d+).*/out $1 in $2/s;
+		printf("%-40s %8.1f MB/s paged %s\n", $ARGV[0],
+			'$SIZE_MB' / (time - $start), $stats);
+	' "$1" "$DGSH_TEE -M -f $2 -o fifo.1 -o fifo.2 -o fifo.3"
+	wait
+	rm -f fifo.*
+}
+
+# Report the throughput and the number of read and write system calls
+# of the dgsh-tee invocation with the arguments passed as the second
+# argument, which must include -P, writing to pipes read by
+# $NSINKS cat processes.
+bench_io()
+{
+	rm -f fifo.*
+	OUT=
+	for i in $(seq $NSINKS)
+	do
+		mkfifo fifo.$i
+		cat fifo.$i >/dev/null &
+		OUT="$OUT -o fifo.$i"
+	done
+	perl -MTime::HiRes=time -e '
+		$start = time;
+		$stats = `cat '$DATA' | $ARGV[1] 2>&1`;
+		$? == 0 || die "$ARGV[0] failed\n";
+		$reads = $writes = 0;
+		$reads += $1 while ($stats =~ m/ Reads: (\d+)/g);
+		$writes += $1 while ($stats =~ m/ Writes: (\d+)/g);
+		printf("%-40s %8.1f MB/s reads %d writes %d\n", $ARGV[0],
+			'$SIZE_MB' / (time - $start), $reads, $writes);
+	' "$1" "$DGSH_TEE -M $2 $OUT"
+	wait
+	rm -f fifo.*
+}
+
+# Report the throughput and the maximum number of buffers allocated
+# by the dgsh-tee invocation with the arguments passed as the third
+# argument, after the input redirection passed as the second argument,
+# writing to four regular files.
+bench_file()
+{
+	perl -MTime::HiRes=time -e '
+		$start = time;
+		$stats = `$ARGV[1] 2>&1`;
+		$? == 0 || die "$ARGV[0] failed\n";
+		$stats =~ s/.*Maximum allocated: (\d+).*/$1/s;
+		printf("%-40s %8.1f MB/s buffers %d\n", $ARGV[0],
+			'$SIZE_MB' / (time - $start), $stats);
+	' "$1" "$2 $DGSH_TEE -M $3 -o file.1 -o file.2 -o file.3 -o file.4"
+	rm -f file.*
+}
+
+# Create lines of varying length, similar to those of text files
+perl -e '
+	$line = "";
+	for ($i = 0; length($line) < 1024 * 1024; $i++) {
+		$line .= "word$i " x ($i % 13) . "\n";
+	}
+	print $line for (1..'$SIZE_MB');
+' >$DATA
+
+bench "Line scatter to $NSINKS sinks" '-s'
+bench "Line scatter to $NSINKS sinks (64k buffer)" '-s -b 64k'
+bench "Line scatter to $NSINKS sinks (4 threads)" '-s -j 4'
+bench "Hash partition to $NSINKS sinks" '-s -S hash -k 1,1'
+bench "Range partition to $NSINKS sinks" '-s -S range -k 1,1'
+bench "Line scatter a file to $NSINKS sinks" "-s -i $DATA"
+bench "Split a file to $NSINKS sinks" "-s -S split -i $DATA"
+bench "Copy to $NSINKS sinks" ''
+bench "Copy to $NSINKS sinks (4 threads)" '-j 4'
+bench_io "Copy to $NSINKS sinks (64k pipes)" '-P 64k'
+bench_io "Copy to $NSINKS sinks (1M pipes)" '-P 1M'
+bench_io "Line scatter to $NSINKS sinks (1M pipes)" '-s -P 1M'
+bench_file "Copy piped data to 4 files" "cat $DATA |" ''
+bench_file "Copy a file to 4 files" '</dev/null' "-i $DATA"
+bench_lag "Copy to mixed-lag sinks" '-b 64k -m 4M'
+bench_lag "Copy to mixed-lag sinks (1M buffer)" '-m 16M'
+bench_lag "Copy to mixed-lag sinks (compressed)" '-C -b 64k -m 4M'
+
+rm -f $DATA
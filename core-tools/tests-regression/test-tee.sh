@@ -34,6 +34,13 @@ charcount()
   uniq -c
 }
 
+# Output the data received from standard input as blocks of the
+# size specified as the argument in hex, one per line
+fixed_blocks()
+{
+  perl -ne 'BEGIN { $/ = \'$1' } print unpack("H*", $_), "\n"'
+}
+
 # Ensure that the numbers in the files passed as 2nd and 3rd arguments
 # about are the same
 # Line format:
@@ -103,11 +110,95 @@ do
 	done
 	rm a
 
+	# Test tees sharing a graph-wide memory budget
+	DGSH_MEMORY=64k $DGSH -c "$DGSH_TEE $flags -b 4096 -i words | $DGSH_TEE $flags -b 4096" >a
+	ensure_same "Graph memory budget $flags" words a
+	rm a
+
+	# Test line scatter of multiple input files
+	cat words $DGSH_TEE_C words | sort >words3
+	$DGSH_TEE $flags -s -b 1000 -i words -i $DGSH_TEE_C -i words -o a -o b -o c -o d
+	cat a b c d | sort >words2
+	ensure_same "Line scatter multiple inputs $flags" words3 words2
+	rm words3
+
+	# Test scatter of an unterminated final record
+	printf 'unterminated\nrecord' >unterminated
+	$DGSH_TEE $flags -s -b 1000 -i words -i unterminated -o a -o b -o c -o d
+	cat words unterminated | fixed_blocks 1 | sort >orig
+	cat a b c d | fixed_blocks 1 | sort >new
+	ensure_same "Unterminated record scatter $flags" orig new
+	rm unterminated orig new
+
 	# Test line scatter efficient algorithm
 	$DGSH_TEE $flags -s -b 128 <words -o a -o b -o c -o d
 	cat a b c d | sort -n >words2
 	ensure_same "Line scatter efficient $flags" words words2
 
+	# Test scatter policies
+	for policy in equal outstanding rate
+	do
+		$DGSH_TEE $flags -s -S $policy -b 128 <words -o a -o b -o c -o d
+		cat a b c d | sort -n >words2
+		ensure_same "Scatter policy $policy $flags" words words2
+	done
+
+	# Test scatter policies to sinks of different speed
+	mkfifo fifo1 fifo2
+	for policy in outstanding rate
+	do
+		cat fifo1 >a &
+		sort -n fifo2 >b &
+		$DGSH_TEE $flags -s -S $policy -b 1000 <words -o fifo1 -o fifo2
+		wait
+		cat a b | sort -n >words2
+		ensure_same "Scatter policy $policy pipes $flags" words words2
+	done
+	rm fifo1 fifo2
+
+	# Test hash partitioning on a key
+	awk '{print substr($2, 1, 1), $1}' words >keyed
+	$DGSH_TEE $flags -s -S hash -k 1,1 -b 128 <keyed -o a -o b -o c -o d
+	cat a b c d | sort -k 2,2n >words2
+	ensure_same "Hash partitioning $flags" keyed words2
+	echo -n "Hash partitioning keys $flags "
+	if [ $(for i in a b c d ; do cut -d' ' -f1 $i | sort -u ; done | sort | uniq -d | wc -l) -ne 0 ]
+	then
+		echo "Hash partitioning keys $flags: key routed to multiple sinks" 1>&2
+		exit 1
+	fi
+	echo OK
+	# Numeric keys that compare equal go to the same partition
+	printf '1 a\n01 b\n1.0 c\n1e1 d\n-0 e\n0 f\n0x10 g\n' >keyed
+	$DGSH_TEE $flags -s -S hash -k 1n -b 128 <keyed -o a -o b -o c -o d
+	echo -n "Hash partitioning numeric keys $flags "
+	if [ $(for i in a b c d ; do grep -c ' [abcd]$' $i ; done | grep -vc '^0$') -ne 1 ] ||
+	   [ $(for i in a b c d ; do grep -c ' [efg]$' $i ; done | grep -vc '^0$') -ne 1 ]
+	then
+		echo "Hash partitioning numeric keys $flags: key routed to multiple sinks" 1>&2
+		exit 1
+	fi
+	echo OK
+	rm keyed
+
+	# Test range partitioning on a key
+	perl -MList::Util=shuffle -e 'srand(1); print shuffle(<>)' words >shuffled
+	$DGSH_TEE $flags -s -S range=4k -k 1n -b 128 <shuffled -o a -o b -o c -o d
+	for i in a b c d ; do sort -n $i ; done >words2
+	ensure_same "Range partitioning $flags" words words2
+	rm shuffled
+
+	# Test splitting a regular file into contiguous parts
+	$DGSH_TEE $flags -s -S split -i words -o a -o b -o c -o d
+	cat a b c d >words2
+	ensure_same "Split file $flags" words words2
+	$DGSH_TEE $flags -s -S split -l 4096 -i words -o a -o b -o c -o d
+	cat a b c d >words2
+	ensure_same "Split file blocks $flags" words words2
+	cat words | $DGSH_TEE $flags -s -S split -o a -o b -o c -o d
+	cat a b c d | sort -n >words2
+	ensure_same "Split pipe $flags" words words2
+
 	# Test with a buffer smaller than line size
 	$DGSH_TEE $flags -s -b 5 <words -o a -o b -o c -o d
 	cat a b c d | sort -n >words2
@@ -127,6 +218,16 @@ do
 	ensure_same "Block scatter $flags" orig new
 	rm a b c d orig new
 
+	# Test fixed-size block scatter
+	$DGSH_TEE $flags -s -l 16 -b 64 <$DGSH_TEE_C -o a -o b -o c -o d
+	fixed_blocks 16 <$DGSH_TEE_C | sort >orig
+	for i in a b c d
+	do
+		fixed_blocks 16 <$i
+	done | sort >new
+	ensure_same "Fixed block scatter $flags" orig new
+	rm a b c d orig new
+
 	# Test plain distribution
 	$DGSH_TEE $flags -b 64 <$DGSH_TEE_C -o a -o b
 	ensure_same "Plain distribution $flags" $DGSH_TEE_C a
@@ -149,18 +250,86 @@ do
 	ensure_same "4->2 distribution $flags" result2 b
 	rm a b result1 result2
 
+	# Test merging of sorted inputs
+	cat -n $WORDS >words
+	for i in 0 1 2
+	do
+		awk "NR % 3 == $i" words >words.$i
+	done
+	$DGSH_TEE $flags -g merge -k 1n -b 64 -i words.0 -i words.1 -i words.2 >a
+	ensure_same "Merge numeric key $flags" words a
+	# Numeric keys are parsed as sort(1) -n parses them
+	printf '0x10\n1e3\n5\n' >words.3
+	printf '2\n7\n' >words.4
+	printf -- '-1.50\ninf\n3\n' >words.5
+	$DGSH_TEE $flags -g merge -k 1n -b 64 -i words.3 -i words.4 -i words.5 >a
+	sort -s -m -n words.3 words.4 words.5 >b
+	ensure_same "Merge sort -n numbers $flags" b a
+	rm words.4 words.5
+	# Right-aligned line numbers also sort lexicographically
+	$DGSH_TEE $flags -g merge -b 64 -i words.0 -i words.1 -i words.2 -o a -o b
+	ensure_same "Merge records $flags" words a
+	ensure_same "Merge records $flags" words b
+	# Gather the inputs' records as they arrive
+	printf 'unterminated' >words.3
+	$DGSH_TEE $flags -g any -b 64 -i words.0 -i words.1 -i words.2 -i words.3 >a
+	sort a >b
+	{ cat words ; echo unterminated ; } | sort >words2
+	ensure_same "Gather records as they arrive $flags" words2 b
+	rm a b words words2 words.0 words.1 words.2 words.3
+
+	# Test order-preserving scatter and gather through lagging map stages
+	cat -n $WORDS >words
+	sed 's/a/A/g' words >words2
+	rm -f fifo1 fifo2 fifo3 fifo4
+	mkfifo fifo1 fifo2 fifo3 fifo4
+	$DGSH_TEE $flags -s -q -b 128 -i words -o fifo1 -o fifo2 &
+	sed 's/a/A/g' <fifo1 >fifo3 &
+	{ sleep 1 ; sed 's/a/A/g' ; } <fifo2 >fifo4 &
+	$DGSH_TEE $flags -g seq -b 128 -i fifo3 -i fifo4 >a
+	wait
+	ensure_same "Sequenced scatter and gather $flags" words2 a
+	rm -f a fifo1 fifo2 fifo3 fifo4 words words2
+
 	# Test permutation
-	$DGSH -c "$DGSH_ENUMERATE 4 | $DGSH_TEE -p 4,2,3,1 | $DGSH_TEE" >a
+	# Without other options the inputs are passed through to the outputs
+	DGSH_DEBUG_LEVEL=2 $DGSH -c "$DGSH_ENUMERATE 4 | $DGSH_TEE -p 4,2,3,1 | $DGSH_TEE" >a 2>err
 	ensure_same "Permutation $flags" a tee/perm.ok
-	rm a
+	echo -n "Permutation pass-through $flags "
+	if ! grep -q 'passed through its inputs' err
+	then
+		echo "Permutation pass-through $flags: inputs not passed through" 1>&2
+		exit 1
+	fi
+	echo OK
+	DGSH_DEBUG_LEVEL=2 $DGSH -c "$DGSH_ENUMERATE 4 | $DGSH_TEE -m 64M -p 4,2,3,1 | $DGSH_TEE" >a 2>err
+	ensure_same "Buffered permutation $flags" a tee/perm.ok
+	echo -n "Buffered permutation copying $flags "
+	if grep -q 'passed through its inputs' err
+	then
+		echo "Buffered permutation copying $flags: inputs passed through" 1>&2
+		exit 1
+	fi
+	echo OK
+	rm a err
+
+	# Test huge page buffers
+	$DGSH_TEE $flags -H -b 2M <$WORDS -o a -o b
+	ensure_same "Huge pages $flags" $WORDS a
+	ensure_same "Huge pages $flags" $WORDS b
+	rm a b
 
 	# Test output to stdout
 	$DGSH_TEE $flags -b 64 <$DGSH_TEE_C >a
 	ensure_same "Stdout $flags" $DGSH_TEE_C a
+	# The data read from a standard input file are consumed
+	{ $DGSH_TEE $flags -b 64 >/dev/null ; cat ; } <$DGSH_TEE_C >a
+	ensure_same "Stdin file consumed $flags" /dev/null a
+	{ $DGSH_TEE $flags -s -S split -o /dev/null -o /dev/null ; cat ; } <$DGSH_TEE_C >a
+	ensure_same "Stdin file split consumed $flags" /dev/null a
 	rm a
 
 	# Test buffering
-	# When -l is supported add, say, -l 16
 	for flags2 in '' '-m 2k' '-m 2k -f'
 	do
 		test="tee-fastout$flags$flags2"
@@ -198,6 +367,250 @@ do
 	ensure_same "Low-memory temporary file (try) $flags" lines try.out
 	ensure_same "Low-memory temporary file (try2) $flags" lines try2.out
 	rm -f lines try try2 try.out try2.out err
+
+	# Test temporary file read-ahead with a lagging pipe
+	rm -f try try2
+	mkfifo try try2
+	cat -n $WORDS | tee lines | $DGSH_TEE -f $flags -b 4096 -m 64k -o try -o try2 &
+	cat try2 >try2.out &
+	{ dd bs=1 count=1 2>/dev/null ; sleep 1 ; cat ; } < try > try.out &
+	wait
+	ensure_same "Temporary file read-ahead (try) $flags" lines try.out
+	ensure_same "Temporary file read-ahead (try2) $flags" lines try2.out
+	rm -f lines try try2 try.out try2.out
+
+	# Test compressed temporary file with a lagging pipe
+	rm -f try try2
+	mkfifo try try2
+	cat -n $WORDS | tee lines | $DGSH_TEE -C -f -M $flags -b 4096 -m 64k -o try -o try2 2>err &
+	cat try2 >try2.out &
+	{ dd bs=1 count=1 2>/dev/null ; sleep 1 ; cat ; } < try > try.out &
+	wait
+	ensure_same "Compressed temporary file (try) $flags" lines try.out
+	ensure_same "Compressed temporary file (try2) $flags" lines try2.out
+	echo -n "Compressed temporary file space $flags "
+	if ! awk '/^Page out:/ && $10 > 0 && $12 < $10 {found = 1} END {exit !found}' err
+	then
+		echo "Compressed temporary file space $flags: data not compressed" 1>&2
+		cat err 1>&2
+		exit 1
+	fi
+	echo OK
+	rm -f lines try try2 try.out try2.out err
+
+	# Test live statistics of a lagging pipe
+	rm -f try
+	mkfifo try
+	cat -n $WORDS | $DGSH_TEE $flags -b 4096 -o try 2>err &
+	tee_pid=$!
+	{ dd bs=1 count=1 2>/dev/null ; sleep 1 ; cat ; } < try > try.out &
+	sleep 0.5
+	kill -USR1 $tee_pid
+	wait
+	echo -n "Live statistics $flags "
+	if ! grep '^Output file: try Written: [0-9]* Lag: [0-9]* Blocked: [0-9.]* Status: blocked$' err >/dev/null
+	then
+		echo "Live statistics $flags: no lagging pipe in output" 1>&2
+		cat err 1>&2
+		exit 1
+	fi
+	echo OK
+	rm -f try try.out err
+
+	# Test live statistics of a lagging pipe fed by a split file
+	rm -f try
+	mkfifo try
+	cat -n $WORDS >lines
+	$DGSH_TEE $flags -s -S split -i lines -o try -o try2 2>err &
+	tee_pid=$!
+	{ dd bs=1 count=1 2>/dev/null ; sleep 1 ; cat ; } < try > try.out &
+	sleep 0.5
+	kill -USR1 $tee_pid
+	wait
+	echo -n "Split live statistics $flags "
+	if ! grep '^Output file: try Written: [0-9]* Lag: [0-9]* Blocked: [0-9.]* Status: blocked$' err >/dev/null
+	then
+		echo "Split live statistics $flags: no lagging pipe in output" 1>&2
+		cat err 1>&2
+		exit 1
+	fi
+	echo OK
+	rm -f lines try try2 try.out err
+
+	# Test a lagging sink that drops records
+	rm -f try try2
+	mkfifo try try2
+	cat -n $WORDS | tee lines | $DGSH_TEE $flags -b 4096 -m 1M -o try -L drop -o try2 &
+	cat try >try.out &
+	{ sleep 1 ; cat ; } < try2 > try2.out &
+	wait
+	ensure_same "Lossy drop (try) $flags" lines try.out
+	echo -n "Lossy drop (try2) $flags "
+	if ! awk 'NR == FNR {line[$0] = 1; next} !($0 in line) {exit 1}' lines try2.out ||
+	    [ $(wc -l <try2.out) -ge $(wc -l <lines) ]
+	then
+		echo "Lossy drop (try2) $flags: not a subset of whole records" 1>&2
+		exit 1
+	fi
+	echo OK
+	rm -f lines try try2 try.out try2.out
+
+	# Test that lossy sinks keeping up receive all records
+	rm -f try try2
+	mkfifo try try2
+	cat -n $WORDS | tee lines | $DGSH_TEE $flags -b 4096 -m 1M -L drop -o try -o try2 &
+	cat try >try.out &
+	cat try2 >try2.out &
+	wait
+	ensure_same "Lossy drop keeping up (try) $flags" lines try.out
+	ensure_same "Lossy drop keeping up (try2) $flags" lines try2.out
+	rm -f lines try try2 try.out try2.out
+
+	# Test sampled and rate-limited sinks
+	cat -n $WORDS | tee lines | $DGSH_TEE $flags -b 4096 -o try -L sample=10 -o try2 -L rate=1k -o try3
+	awk 'NR % 10 == 1' lines >try2.expected
+	ensure_same "Lossy copy $flags" lines try
+	ensure_same "Lossy sample $flags" try2.expected try2
+	echo -n "Lossy rate $flags "
+	if ! awk 'NR == FNR {line[$0] = 1; next} !($0 in line) {exit 1}' lines try3 ||
+	    [ ! -s try3 ] || [ $(wc -c <try3) -ge $(wc -c <lines) ]
+	then
+		echo "Lossy rate $flags: not a subset of whole records" 1>&2
+		exit 1
+	fi
+	echo OK
+	rm -f lines try try2 try3 try2.expected
+
+	# Test pipe capacity tuning and reads spanning buffers
+	rm -f try
+	mkfifo try
+	cat -n $WORDS | tee lines | $DGSH_TEE -M -P 256k $flags -b 4096 -o try 2>err &
+	cat try >try.out &
+	wait
+	ensure_same "Pipe tuning $flags" lines try.out
+	echo -n "Pipe tuning statistics $flags "
+	if ! grep '^Input file: standard input Pipe size: [0-9]* Reads: [1-9][0-9]* Average: [0-9]*$' err >/dev/null ||
+	    ! grep '^Output file: try Pipe size: [0-9]* Writes: [1-9][0-9]* Average: [0-9]*$' err >/dev/null
+	then
+		echo "Pipe tuning statistics $flags: missing I/O counts" 1>&2
+		cat err 1>&2
+		exit 1
+	fi
+	echo OK
+	rm -f lines try try.out err
+
+	# Test a mapped file input to a file and to a lagging pipe
+	rm -f try
+	mkfifo try
+	cat -n $WORDS >lines
+	$DGSH_TEE -M $flags -b 4096 -m 64k -i lines -o try -o try2 </dev/null 2>err &
+	{ dd bs=1 count=1 2>/dev/null ; sleep 1 ; cat ; } < try > try.out &
+	wait
+	ensure_same "Mapped input (try) $flags" lines try.out
+	ensure_same "Mapped input (try2) $flags" lines try2
+	echo -n "Mapped input statistics $flags "
+	if ! grep '^Buffers allocated: 0 .* Mapped: [1-9][0-9]*$' err >/dev/null
+	then
+		echo "Mapped input statistics $flags: buffers allocated for a mapped file" 1>&2
+		cat err 1>&2
+		exit 1
+	fi
+	echo OK
+	rm -f lines try try2 try.out err
+
+	# Test zero-copy transfer to a fast and a lagging pipe
+	rm -f try try2
+	mkfifo try try2
+	cat -n $WORDS | tee lines | $DGSH_TEE -z $flags -b 4096 -o try -o try2 &
+	cat try2 >try2.out &
+	{ dd bs=1 count=1 2>/dev/null ; sleep 1 ; cat ; } < try > try.out &
+	wait
+	ensure_same "Zero-copy (try) $flags" lines try.out
+	ensure_same "Zero-copy (try2) $flags" lines try2.out
+	rm -f lines try try2 try.out try2.out
+
+	# Test writer threads
+	for writers in 1 3
+	do
+		$DGSH_TEE -j $writers $flags -b 64 <$DGSH_TEE_C -o a -o b -o c -o d
+		for i in a b c d
+		do
+			ensure_same "Threads $writers copy $flags" $DGSH_TEE_C $i
+		done
+
+		cat -n $WORDS >words
+		$DGSH_TEE -j $writers $flags -s -b 128 <words -o a -o b -o c -o d
+		cat a b c d | sort -n >words2
+		ensure_same "Threads $writers line scatter $flags" words words2
+
+		$DGSH_TEE -j $writers $flags -s -l 16 -b 64 <$DGSH_TEE_C -o a -o b -o c -o d
+		fixed_blocks 16 <$DGSH_TEE_C | sort >orig
+		for i in a b c d
+		do
+			fixed_blocks 16 <$i
+		done | sort >new
+		ensure_same "Threads $writers fixed block scatter $flags" orig new
+
+		cat $WORDS /etc/services >result1
+		cat $DGSH_TEE_C /etc/hosts >result2
+		$DGSH_TEE -j $writers $flags -b 64 -i $WORDS -i $DGSH_TEE_C -i /etc/services -i /etc/hosts -o a -o b
+		ensure_same "Threads $writers 4->2 distribution $flags" result1 a
+		ensure_same "Threads $writers 4->2 distribution $flags" result2 b
+
+		$DGSH -c "$DGSH_ENUMERATE 4 | $DGSH_TEE -j $writers -p 4,2,3,1 | $DGSH_TEE" >a
+		ensure_same "Threads $writers permutation $flags" a tee/perm.ok
+		rm a b c d words words2 orig new result1 result2
+	done
+
+	# Test writer threads with a fast and a lagging pipe
+	rm -f try try2
+	mkfifo try try2
+	cat -n $WORDS | tee lines | $DGSH_TEE -j 2 $flags -b 4096 -o try -o try2 &
+	cat try2 >try2.out &
+	{ dd bs=1 count=1 2>/dev/null ; sleep 1 ; cat ; } < try > try.out &
+	wait
+	ensure_same "Threads lagging pipe (try) $flags" lines try.out
+	ensure_same "Threads lagging pipe (try2) $flags" lines try2.out
+	rm -f lines try try2 try.out try2.out
+done
+
+# Test that tees share the graph-wide memory budget
+# The tee feeding a fast and a lagging branch, and the tee on the
+# lagging branch, would each fill the 16 buffers of an unshared budget.
+cat -n $WORDS >lines
+DGSH_MEMORY=64k $DGSH -c "
+cat lines |
+$DGSH_TEE -M -b 4096 |
+{{
+	$DGSH_TEE -M -b 4096 | sh -c 'sleep 1; exec cat' >a
+	cat >b
+}}" 2>err
+ensure_same "Graph memory budget sharing (a)" lines a
+ensure_same "Graph memory budget sharing (b)" lines b
+echo -n "Graph memory budget sharing "
+if ! awk '/Maximum allocated/ {n++; if ($8 >= 16) full = 1} END {exit full || n != 2}' err
+then
+	echo "Graph memory budget sharing: a tee used the whole budget" 1>&2
+	cat err 1>&2
+	exit 1
+fi
+echo OK
+rm -f lines a b err
+
+# Test writer threads with piped input chains exceeding the memory limit
+for writers in 1 2
+do
+	rm -f try try2
+	mkfifo try try2
+	cat -n $WORDS >lines
+	cat $WORDS >words
+	cat lines >try &
+	cat words >try2 &
+	$DGSH_TEE -j $writers -b 4096 -m 64k -i try -i try2 -o a -o b
+	wait
+	ensure_same "Threads $writers piped inputs (a)" lines a
+	ensure_same "Threads $writers piped inputs (b)" words b
+	rm -f lines words try try2 a b
 done
 
 # Test asynchronous reading from multiple input files
@@ -218,4 +631,49 @@ do
 	rm -f a b c d expect
 done
 
+# Test negotiation through a broker without the dgsh shell:
+# connect through socket pairs, as the shell does, the graph
+# tee -i words | conc -o 2 | {{ tee ; tee ; }} | conc -i 2 | tee -o out
+rm -f out
+dgsh-broker perl -MSocket -MPOSIX -MFcntl -e '
+	($bin, $in, $out) = @ARGV;
+	sub edge {
+		socketpair(my $w, my $r, AF_UNIX, SOCK_STREAM, PF_UNSPEC) ||
+			die "socketpair: $!";
+		return [$w, $r];
+	}
+	# Run a command with the specified fds 0, 1, and 3
+	sub run {
+		my ($in, $out, $fd3, @argv) = @_;
+		defined(my $pid = fork()) || die "fork: $!";
+		return $pid if ($pid);
+		dup2(fileno($in), 0) if ($in);
+		dup2(fileno($out), 1) if ($out);
+		if ($fd3 && fileno($fd3) == 3) {
+			fcntl($fd3, F_SETFD, 0);
+		} elsif ($fd3) {
+			dup2(fileno($fd3), 3);
+		}
+		$ENV{DGSH_IN} = $in ? 1 : 0;
+		$ENV{DGSH_OUT} = $out ? 1 : 0;
+		exec(@argv) || die "$argv[0]: $!";
+	}
+	@e = map { edge() } 1..6;
+	run(undef, $e[0][0], undef, "$bin/dgsh-tee", "-i", $in);
+	run($e[0][1], $e[1][0], $e[2][0], "$bin/dgsh-conc", "-o", "2");
+	run($e[1][1], $e[3][0], undef, "$bin/dgsh-tee");
+	run($e[2][1], $e[4][0], undef, "$bin/dgsh-tee");
+	run($e[3][1], $e[5][0], $e[4][1], "$bin/dgsh-conc", "-i", "2");
+	run($e[5][1], undef, undef, "$bin/dgsh-tee", "-o", $out);
+	@e = ();
+	$status = 0;
+	while (wait() != -1) {
+		$status ||= $?;
+	}
+	exit($status ? 1 : 0);
+' $DGSHPATH $WORDS out || exit 1
+cat $WORDS $WORDS >expect
+ensure_same "Broker scatter gather" expect out
+rm -f out expect
+
 exit 0